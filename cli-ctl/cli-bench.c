@@ -0,0 +1,203 @@
+/*
+ * cli 服务端压测: 建立多个连接, 每个连接上循环执行同一条命令(每个连接一个请求在途),
+ * 输出吞吐, 延迟分位数, 以及服务端每个命令的系统调用数(执行前后各取一次 show cli server).
+ *
+ *   ./cli-bench [-c 连接数] [-n 总请求数] [-s socket] [命令]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include "cli_client.h"
+
+#define SOCKET_PATH "/tmp/command_socket"
+
+typedef struct
+{
+    cli_client_t client;
+    /* 当前请求的发送时间 */
+    uint64_t start;
+} bench_conn_t;
+
+/* show cli server 中关心的计数 */
+typedef struct
+{
+    char backend[16];
+    unsigned long long commands;
+    unsigned long long process_calls;
+    unsigned long long syscalls;
+} bench_server_stats_t;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* 收集命令输出 */
+static void collect_output(void *arg, uint32_t request_id, const char *data, int len)
+{
+    char *buf = arg;
+    int n = strlen(buf);
+
+    if (n + len >= 1024)
+        len = 1023 - n;
+    memcpy(buf + n, data, len);
+    buf[n + len] = 0;
+}
+
+static int server_stats(const char *path, bench_server_stats_t *st)
+{
+    cli_client_t c;
+    char output[1024] = "";
+    char *line;
+    int status;
+
+    if (cli_client_connect(&c, path))
+        return -1;
+    if (cli_client_execute(&c, "show cli server", &status, collect_output, output) || status) {
+        cli_client_close(&c);
+        return -1;
+    }
+    cli_client_close(&c);
+
+    memset(st, 0, sizeof(*st));
+    for (line = strtok(output, "\n"); line; line = strtok(0, "\n")) {
+        sscanf(line, "backend: %15s", st->backend);
+        sscanf(line, "commands: %llu", &st->commands);
+        sscanf(line, "process calls: %llu", &st->process_calls);
+        sscanf(line, "syscalls: %llu", &st->syscalls);
+    }
+    return 0;
+}
+
+static int send_request(bench_conn_t *bc, const char *command)
+{
+    uint32_t request_id;
+
+    bc->start = now_ns();
+    return cli_client_send(&bc->client, command, strlen(command), &request_id);
+}
+
+int main(int argc, char **argv) {
+    const char *path = SOCKET_PATH, *command = "show instance id 1";
+    int connections = 1000, requests = 200000;
+    int sent = 0, done = 0, epoll_fd, i, opt;
+    bench_server_stats_t before, after;
+    struct epoll_event ev, events[256];
+    struct rlimit rl;
+    bench_conn_t *conns;
+    uint64_t *latency, t0, t1;
+
+    while ((opt = getopt(argc, argv, "c:n:s:")) != -1) {
+        switch (opt) {
+            case 'c': connections = atoi(optarg); break;
+            case 'n': requests = atoi(optarg); break;
+            case 's': path = optarg; break;
+            default:
+                fprintf(stderr, "Usage: %s [-c connections] [-n requests] [-s socket] [command]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind < argc)
+        command = argv[optind];
+    if (connections <= 0 || requests < connections) {
+        fprintf(stderr, "need 0 < connections <= requests\n");
+        return 1;
+    }
+
+    // 连接数多时需要更多的 fd
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    conns = calloc(connections, sizeof(bench_conn_t));
+    latency = malloc(requests * sizeof(uint64_t));
+    epoll_fd = epoll_create1(0);
+    if (!conns || !latency || epoll_fd < 0) {
+        perror("init");
+        return 1;
+    }
+
+    for (i = 0; i < connections; i++) {
+        if (cli_client_connect(&conns[i].client, path)) {
+            fprintf(stderr, "connect %d failed\n", i);
+            return 1;
+        }
+        ev.events = EPOLLIN;
+        ev.data.ptr = &conns[i];
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conns[i].client.fd, &ev);
+    }
+
+    if (server_stats(path, &before)) {
+        fprintf(stderr, "show cli server failed\n");
+        return 1;
+    }
+
+    t0 = now_ns();
+    for (i = 0; i < connections; i++, sent++) {
+        if (send_request(&conns[i], command))
+            return 1;
+    }
+
+    // 收到回复后马上在同一个连接上发送下一个请求
+    while (done < requests) {
+        int n = epoll_wait(epoll_fd, events, 256, -1);
+
+        for (i = 0; i < n; i++) {
+            bench_conn_t *bc = events[i].data.ptr;
+            uint32_t request_id;
+            int status;
+
+            if (cli_client_recv(&bc->client, &request_id, &status, 0, 0) || status) {
+                fprintf(stderr, "request failed (status %d)\n", status);
+                return 1;
+            }
+            latency[done++] = now_ns() - bc->start;
+            if (sent < requests) {
+                if (send_request(bc, command))
+                    return 1;
+                sent++;
+            }
+        }
+    }
+    t1 = now_ns();
+
+    if (server_stats(path, &after)) {
+        fprintf(stderr, "show cli server failed\n");
+        return 1;
+    }
+
+    qsort(latency, requests, sizeof(uint64_t), compare_u64);
+
+    // 统计区间内还包括两次 show cli server 本身
+    after.commands -= before.commands + 1;
+    after.process_calls -= before.process_calls;
+    after.syscalls -= before.syscalls;
+
+    printf("backend %s, %d connections, %d requests in %.2f s (%.0f req/s)\n",
+           after.backend, connections, requests, (t1 - t0) / 1e9, requests * 1e9 / (t1 - t0));
+    printf("latency us: p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+           latency[requests / 2] / 1e3, latency[(uint64_t) requests * 99 / 100] / 1e3,
+           latency[(uint64_t) requests * 999 / 1000] / 1e3, latency[requests - 1] / 1e3);
+    printf("server syscalls per command: %.2f (+ %.2f host poll wakeups)\n",
+           after.commands ? (double) after.syscalls / after.commands : 0.0,
+           after.commands ? (double) after.process_calls / after.commands : 0.0);
+
+    for (i = 0; i < connections; i++)
+        cli_client_close(&conns[i].client);
+    return 0;
+}
@@ -7,6 +7,7 @@
 #include <termios.h>
 #include <signal.h>
 #include <ctype.h>
+#include "cli_client.h"
 
 #define SOCKET_PATH "/tmp/command_socket"
 #define BUFFER_SIZE 1024
@@ -14,17 +15,15 @@
 
 // 全局变量
 struct termios original_term;
-int sock_fd = -1;
+cli_client_t client = { .fd = -1 };
 
 // 信号处理函数
 void handle_signal(int sig) {
     // 恢复终端原始设置
     tcsetattr(STDIN_FILENO, TCSANOW, &original_term);
     
-    // 关闭套接字（如果已打开）
-    if (sock_fd >= 0) {
-        close(sock_fd);
-    }
+    // 关闭连接（如果已打开）
+    cli_client_close(&client);
     
     printf("\nProgram terminated by signal %d\n", sig);
     exit(EXIT_FAILURE);
@@ -71,10 +70,100 @@ int handle_escape_sequence() {
     return 0; // 不是方向键或未处理
 }
 
-int main() {
-    struct sockaddr_un server_addr;
+// 命令输出直接写到标准输出
+static void print_output(void *arg, uint32_t request_id, const char *data, int len) {
+    int *printed = arg;
+
+    fwrite(data, 1, len, stdout);
+    *printed = 1;
+}
+
+// 执行一条命令并打印输出, 返回命令的返回值, 连接出错时返回 -1
+static int execute(const char *line, int *error) {
+    int status = 0, printed = 0;
+
+    *error = cli_client_execute(&client, line, &status, print_output, &printed);
+    if (printed)
+        printf("\n");
+    fflush(stdout);
+    return status;
+}
+
+// 流水线执行标准输入中的命令时的状态
+typedef struct {
+    char line[BUFFER_SIZE];
+    int printed;
+    int status;
+} script_t;
+
+// 从标准输入读取下一条命令, 跳过空行
+static const char *script_next(void *arg, int *len) {
+    script_t *sc = arg;
+
+    while (fgets(sc->line, sizeof(sc->line), stdin)) {
+        sc->line[strcspn(sc->line, "\n")] = '\0';
+        if (sc->line[0] != '\0') {
+            *len = strlen(sc->line);
+            return sc->line;
+        }
+    }
+    return NULL;
+}
+
+static void script_output(void *arg, uint32_t request_id, const char *data, int len) {
+    script_t *sc = arg;
+
+    print_output(&sc->printed, request_id, data, len);
+}
+
+static void script_done(void *arg, uint32_t request_id, int status) {
+    script_t *sc = arg;
+
+    if (sc->printed)
+        printf("\n");
+    sc->printed = 0;
+    sc->status |= status;
+}
+
+// 非交互模式: 执行命令行参数中的命令, 或者流水线执行标准输入中的所有命令
+static int run_script(int argc, char **argv) {
+    char line[BUFFER_SIZE];
+    int status = 0, error = 0;
+
+    if (cli_client_connect(&client, SOCKET_PATH) < 0) {
+        perror("connection failed");
+        return EXIT_FAILURE;
+    }
+
+    if (argc > 1) {
+        int i, len = 0;
+
+        line[0] = '\0';
+        for (i = 1; i < argc; i++)
+            len += snprintf(line + len, len < (int)sizeof(line) ? sizeof(line) - len : 0,
+                            "%s%s", i > 1 ? " " : "", argv[i]);
+        status = execute(line, &error);
+    } else {
+        static script_t sc;
+
+        // 不等回复连续发送, 回复按顺序到达
+        error = cli_client_pipeline(&client, 1024, script_next, script_output, script_done, &sc);
+        fflush(stdout);
+        status = sc.status;
+    }
+
+    if (error)
+        fprintf(stderr, "Server disconnected\n");
+    cli_client_close(&client);
+    return error || status ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv) {
     char buffer[BUFFER_SIZE];
-    ssize_t bytes_read;
+
+    // 带参数或者标准输入不是终端时, 按脚本方式执行
+    if (argc > 1 || !isatty(STDIN_FILENO))
+        return run_script(argc, argv);
 
     // 注册信号处理函数
     signal(SIGINT, handle_signal);
@@ -84,22 +173,9 @@ int main() {
     tcgetattr(STDIN_FILENO, &original_term);
     set_terminal_raw();
 
-    // 创建Unix域套接字
-    if ((sock_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
-        perror("socket creation failed");
-        tcsetattr(STDIN_FILENO, TCSANOW, &original_term);
-        exit(EXIT_FAILURE);
-    }
-
-    // 配置服务器地址
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sun_family = AF_UNIX;
-    strncpy(server_addr.sun_path, SOCKET_PATH, sizeof(server_addr.sun_path) - 1);
-
     // 连接到服务器
-    if (connect(sock_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+    if (cli_client_connect(&client, SOCKET_PATH) < 0) {
         perror("connection failed");
-        close(sock_fd);
         tcsetattr(STDIN_FILENO, TCSANOW, &original_term);
         exit(EXIT_FAILURE);
     }
@@ -150,29 +226,16 @@ int main() {
                     goto disconnect;
                 }
 
-                // 发送命令到服务器
+                // 发送命令到服务器并打印回复
                 if (pos > 0) {
-                    write(sock_fd, buffer, pos);
-                    
-                    // 读取服务器响应
-                    bytes_read = read(sock_fd, buffer, BUFFER_SIZE - 1);
-                    if (bytes_read <= 0) {
-                        // 服务器断开连接
-                        if (bytes_read == 0) {
-                            printf("Server disconnected\n");
-                        } else {
-                            perror("read from server failed");
-                        }
+                    int error;
+
+                    execute(buffer, &error);
+                    if (error) {
+                        printf("Server disconnected\n");
                         goto disconnect;
                     }
-                    
-                    if (bytes_read == 1) {
-                        /* 只有占位符 */
-                        printf("\n%s", PROMPT);
-                    } else {
-                        buffer[bytes_read] = '\0';
-                        printf("%s\n%s", buffer, PROMPT);
-                    }
+                    printf("%s", PROMPT);
                     fflush(stdout);
                 } else {
                     // 没有输入命令，只打印新提示符
@@ -217,7 +280,7 @@ int main() {
 
 disconnect:
     printf("Disconnecting from server...\n");
-    close(sock_fd);
+    cli_client_close(&client);
     tcsetattr(STDIN_FILENO, TCSANOW, &original_term);
     return 0;
 }
\ No newline at end of file
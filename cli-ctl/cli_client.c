@@ -0,0 +1,294 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include "../cli_proto.h"
+#include "cli_client.h"
+
+/* 每次 read 至少预留的空间 */
+#define CLI_CLIENT_READ_SIZE 4096
+
+int cli_client_connect (cli_client_t *c, const char *path)
+{
+    struct sockaddr_un addr;
+
+    memset(c, 0, sizeof(*c));
+    c->next_request_id = 1;
+
+    if ((c->fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    if (connect(c->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+void cli_client_close (cli_client_t *c)
+{
+    if (c->fd >= 0)
+        close(c->fd);
+    c->fd = -1;
+    free(c->rx_buffer);
+    c->rx_buffer = 0;
+    c->rx_start = c->rx_len = c->rx_capacity = 0;
+}
+
+int cli_client_send (cli_client_t *c, const char *line, int len, uint32_t *request_id)
+{
+    char header[CLI_FRAME_HEADER_SIZE];
+    struct iovec iov[2];
+    int n_iov = 2;
+
+    if (len > CLI_FRAME_MAX_PAYLOAD)
+        return -1;
+
+    *request_id = c->next_request_id++;
+    cli_frame_header_encode(header, len, *request_id, CLI_FRAME_REQUEST, 0);
+
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (void *) line;
+    iov[1].iov_len = len;
+
+    /* 处理部分写 */
+    while (n_iov) {
+        ssize_t n = writev(c->fd, iov + 2 - n_iov, n_iov);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        while (n_iov && (size_t) n >= iov[2 - n_iov].iov_len) {
+            n -= iov[2 - n_iov].iov_len;
+            n_iov--;
+        }
+        if (n_iov) {
+            iov[2 - n_iov].iov_base = (char *) iov[2 - n_iov].iov_base + n;
+            iov[2 - n_iov].iov_len -= n;
+        }
+    }
+
+    return 0;
+}
+
+/* 确保接收缓冲至少还有 CLI_CLIENT_READ_SIZE 的空间 */
+static int cli_client_rx_reserve (cli_client_t *c)
+{
+    if (c->rx_start) {
+        memmove(c->rx_buffer, c->rx_buffer + c->rx_start, c->rx_len - c->rx_start);
+        c->rx_len -= c->rx_start;
+        c->rx_start = 0;
+    }
+
+    if (c->rx_capacity - c->rx_len < CLI_CLIENT_READ_SIZE) {
+        int capacity = c->rx_capacity ? c->rx_capacity << 1 : CLI_CLIENT_READ_SIZE;
+        char *p;
+
+        while (capacity - c->rx_len < CLI_CLIENT_READ_SIZE)
+            capacity <<= 1;
+        p = (char *) realloc(c->rx_buffer, capacity);
+        if (!p)
+            return -1;
+        c->rx_buffer = p;
+        c->rx_capacity = capacity;
+    }
+
+    return 0;
+}
+
+/* 读取更多数据到接收缓冲, 非阻塞时没有数据返回 0 */
+static int cli_client_read (cli_client_t *c)
+{
+    ssize_t n;
+
+    if (cli_client_rx_reserve(c))
+        return -1;
+
+    do {
+        n = read(c->fd, c->rx_buffer + c->rx_len, c->rx_capacity - c->rx_len);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return 0;
+    if (n <= 0)
+        return -1;
+
+    c->rx_len += n;
+    return 0;
+}
+
+/*
+ * 处理接收缓冲中的帧, OUTPUT 帧交给 fn, 遇到 DONE 帧时返回 1,
+ * 缓冲中没有完整的帧时返回 0, 数据不合法时返回 -1.
+ */
+static int cli_client_process (cli_client_t *c, uint32_t *request_id, int *status,
+                               cli_client_output_function_t *fn, void *arg)
+{
+    cli_frame_header_t h;
+
+    while (c->rx_len - c->rx_start >= CLI_FRAME_HEADER_SIZE) {
+        const char *frame = c->rx_buffer + c->rx_start;
+
+        cli_frame_header_decode(frame, &h);
+        if (h.length > CLI_FRAME_MAX_PAYLOAD)
+            return -1;
+        if (c->rx_len - c->rx_start < CLI_FRAME_HEADER_SIZE + (int) h.length)
+            return 0;
+        c->rx_start += CLI_FRAME_HEADER_SIZE + h.length;
+
+        switch (h.type) {
+            case CLI_FRAME_OUTPUT:
+                if (fn && h.length)
+                    fn(arg, h.request_id, frame + CLI_FRAME_HEADER_SIZE, h.length);
+                break;
+            case CLI_FRAME_DONE:
+                *request_id = h.request_id;
+                *status = h.status;
+                return 1;
+            default:
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+int cli_client_recv (cli_client_t *c, uint32_t *request_id, int *status,
+                     cli_client_output_function_t *fn, void *arg)
+{
+    int rv;
+
+    while (!(rv = cli_client_process(c, request_id, status, fn, arg))) {
+        if (cli_client_read(c))
+            return -1;
+    }
+
+    return rv < 0 ? -1 : 0;
+}
+
+int cli_client_pipeline (cli_client_t *c, int max_in_flight,
+                         cli_client_next_function_t *next,
+                         cli_client_output_function_t *output,
+                         cli_client_done_function_t *done, void *arg)
+{
+    char *tx = 0;
+    int tx_start = 0, tx_len = 0, tx_capacity = 0;
+    int in_flight = 0, more = 1, error = 0;
+    int flags = fcntl(c->fd, F_GETFL, 0);
+
+    /* 发送和接收交替进行, 两边都不能阻塞, 否则双方的 socket 缓冲都满时会互相等待 */
+    fcntl(c->fd, F_SETFL, flags | O_NONBLOCK);
+
+    while (!error) {
+        struct pollfd pfd;
+
+        /* 把后续命令编码到发送缓冲, 发送缓冲不超过 64K */
+        while (more && in_flight < max_in_flight && tx_len - tx_start < (64 << 10)) {
+            const char *line;
+            int len;
+
+            if (!(line = next(arg, &len))) {
+                more = 0;
+                break;
+            }
+            if (len > CLI_FRAME_MAX_PAYLOAD) {
+                error = -1;
+                break;
+            }
+            if (tx_capacity - tx_len < CLI_FRAME_HEADER_SIZE + len) {
+                int capacity = tx_capacity ? tx_capacity : 4096;
+                char *p;
+
+                if (tx_start) {
+                    memmove(tx, tx + tx_start, tx_len - tx_start);
+                    tx_len -= tx_start;
+                    tx_start = 0;
+                }
+                while (capacity - tx_len < CLI_FRAME_HEADER_SIZE + len)
+                    capacity <<= 1;
+                if (!(p = (char *) realloc(tx, capacity))) {
+                    error = -1;
+                    break;
+                }
+                tx = p;
+                tx_capacity = capacity;
+            }
+            cli_frame_header_encode(tx + tx_len, len, c->next_request_id++, CLI_FRAME_REQUEST, 0);
+            memcpy(tx + tx_len + CLI_FRAME_HEADER_SIZE, line, len);
+            tx_len += CLI_FRAME_HEADER_SIZE + len;
+            in_flight++;
+        }
+
+        if (error || (!more && in_flight == 0))
+            break;
+
+        pfd.fd = c->fd;
+        pfd.events = POLLIN | (tx_len > tx_start ? POLLOUT : 0);
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            error = -1;
+            break;
+        }
+
+        if (pfd.revents & POLLOUT) {
+            ssize_t n = write(c->fd, tx + tx_start, tx_len - tx_start);
+            if (n > 0)
+                tx_start += n;
+            else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                error = -1;
+            if (tx_start == tx_len)
+                tx_start = tx_len = 0;
+        }
+
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+            uint32_t id;
+            int status, rv;
+
+            if (cli_client_read(c)) {
+                error = -1;
+                break;
+            }
+            while ((rv = cli_client_process(c, &id, &status, output, arg)) > 0) {
+                in_flight--;
+                if (done)
+                    done(arg, id, status);
+            }
+            if (rv < 0)
+                error = -1;
+        }
+    }
+
+    fcntl(c->fd, F_SETFL, flags);
+    free(tx);
+    return error;
+}
+
+int cli_client_execute (cli_client_t *c, const char *line, int *status,
+                        cli_client_output_function_t *fn, void *arg)
+{
+    uint32_t id, done_id;
+
+    if (cli_client_send(c, line, strlen(line), &id))
+        return -1;
+
+    /* 一次只有一个请求在途, 回复一定属于这个请求 */
+    if (cli_client_recv(c, &done_id, status, fn, arg))
+        return -1;
+
+    return done_id == id ? 0 : -1;
+}
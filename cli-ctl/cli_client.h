@@ -0,0 +1,59 @@
+#ifndef CLI_CLIENT_H_
+#define CLI_CLIENT_H_
+
+#include <stdint.h>
+
+/* 与 cli 服务端的一个连接 */
+typedef struct
+{
+  int fd;
+  /* 下一个请求使用的 request id */
+  uint32_t next_request_id;
+  /* 接收缓冲, 保存还没有处理的回复数据 */
+  char *rx_buffer;
+  /* 未处理的数据为 rx_buffer[rx_start, rx_len) */
+  int rx_start;
+  int rx_len;
+  int rx_capacity;
+} cli_client_t;
+
+/* 收到命令输出时的回调 */
+typedef void (cli_client_output_function_t) (void *arg, uint32_t request_id,
+                                             const char *data, int len);
+
+int cli_client_connect (cli_client_t *c, const char *path);
+
+void cli_client_close (cli_client_t *c);
+
+/* 发送一条命令, *request_id 返回该请求的 id */
+int cli_client_send (cli_client_t *c, const char *line, int len, uint32_t *request_id);
+
+/*
+ * 接收一个请求的完整回复: 每个 OUTPUT 帧的数据交给 fn, 收到 DONE 帧时返回,
+ * *request_id 和 *status 为该请求的 id 和命令返回值.
+ * 返回 -1 表示连接已关闭或出错.
+ */
+int cli_client_recv (cli_client_t *c, uint32_t *request_id, int *status,
+                     cli_client_output_function_t *fn, void *arg);
+
+/* 流水线执行时获取下一条命令, 没有更多命令时返回 0 */
+typedef const char *(cli_client_next_function_t) (void *arg, int *len);
+
+/* 收到一个请求的 DONE 帧时的回调 */
+typedef void (cli_client_done_function_t) (void *arg, uint32_t request_id, int status);
+
+/*
+ * 流水线方式执行命令: 不等回复连续发送 next 给出的命令, 同时接收回复,
+ * 在途的请求最多 max_in_flight 个. 回复按请求的顺序到达, 每个请求的输出都在它的 DONE 之前.
+ * 所有请求都收到回复后返回 0, 连接出错返回 -1.
+ */
+int cli_client_pipeline (cli_client_t *c, int max_in_flight,
+                         cli_client_next_function_t *next,
+                         cli_client_output_function_t *output,
+                         cli_client_done_function_t *done, void *arg);
+
+/* 发送一条命令并等待它的回复 */
+int cli_client_execute (cli_client_t *c, const char *line, int *status,
+                        cli_client_output_function_t *fn, void *arg);
+
+#endif
@@ -5,160 +5,359 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/uio.h>
 #include "cli.h"
+#include "cli_proto.h"
 
 /* 主要控制结构 */
 cli_main_t cm;
 
+/* 当前线程注册的状态, 为 0 时使用 cm.main_thread */
+static __thread cli_thread_t *cli_thread_current;
+
+cli_thread_t *cli_thread_self(void)
+{
+    return cli_thread_current ? cli_thread_current : &cm.main_thread;
+}
+
 /* 初始命令数量 */
 #define INITIAL_COMMAND_NUM 10
 
-/* 每个注册命令有这么一个结构  */
-typedef struct cmd_node {
-    char* path;
+/*
+ * 命令索引使用的开放寻址哈希表.
+ * 每个槽位保存完整的 32 位 hash, 扩容时直接使用, 不必重新计算;
+ * 另外每个槽位有一个 tag 字节(hash 的高 7 位, 最高位置 1 表示占用), 集中存放在 tags 数组中,
+ * 探测时先比较 tag, 只有 tag 和 hash 都相同才去比较 key 本身.
+ * key 以 (指针, 长度) 的形式保存, 表中不复制字符串, 由调用者保证 key 的生命周期.
+ */
+typedef struct {
+    const char *key;
+    int key_len;
+    uint32_t hash;
     int cmd_index;         /* 在 cm. commands 中的位置 */
-    struct cmd_node* next;
-} cmd_node_t;
+} cmd_slot_t;
 
 typedef struct {
-    cmd_node_t** buckets;
-    int size;
+    uint8_t *tags;
+    cmd_slot_t *slots;
+    int size;              /* 2 的幂 */
     int count;
 } cmd_hash_table_t;
 
-// 哈希函数（djb2算法）
-unsigned long hash(const char* str) {
-    unsigned long hash = 5381;
-    int c;
-    while ((c = *str++)) {
-        hash = ((hash << 5) + hash) + c; // hash * 33 + c
+#define CMD_HASH_TAG_EMPTY 0
+
+static inline uint8_t cmd_hash_tag (uint32_t h)
+{
+    return 0x80 | (h >> 25);
+}
+
+// 哈希函数（FNV-1a, 再做一次 murmur3 的 finalizer 打散低位）
+static inline uint32_t cli_hash (const char *key, int len)
+{
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        h ^= (uint8_t)key[i];
+        h *= 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+static int hash_table_init(cmd_hash_table_t* table, int size)
+{
+    table->tags = (uint8_t*)calloc(size, sizeof(uint8_t));
+    table->slots = (cmd_slot_t*)malloc(size * sizeof(cmd_slot_t));
+    if (!table->tags || !table->slots) {
+        free(table->tags);
+        free(table->slots);
+        return -1;
     }
-    return hash;
+    table->size = size;
+    table->count = 0;
+    return 0;
 }
 
 void* hash_table_create() {
     cmd_hash_table_t* table = (cmd_hash_table_t*)malloc(sizeof(cmd_hash_table_t));
     if (!table) return 0;
     
-    table->size = 32;
-    table->count = 0;
-    table->buckets = (cmd_node_t**)calloc(table->size, sizeof(cmd_node_t*));
-    if (!table->buckets) {
+    if (hash_table_init(table, 32)) {
         free(table);
         return 0;
     }
     return (void*)table;
 }
 
-// 动态调整哈希表大小
-void hash_table_resize(cmd_hash_table_t* table, int new_size) {
-    cmd_node_t** new_buckets = (cmd_node_t**)calloc(new_size, sizeof(cmd_node_t*));
-    if (!new_buckets) return;
+/* 线性探测, 返回 key 所在的槽位, 不存在时返回第一个空槽位 */
+static inline int hash_table_probe(cmd_hash_table_t* table, const char* key, int len, uint32_t h)
+{
+    int mask = table->size - 1;
+    int idx = h & mask;
+    uint8_t tag = cmd_hash_tag(h);
+
+    while (1) {
+        uint8_t t = table->tags[idx];
+        if (t == CMD_HASH_TAG_EMPTY)
+            return idx;
+        if (t == tag) {
+            cmd_slot_t *slot = &table->slots[idx];
+            if (slot->hash == h && slot->key_len == len && memcmp(slot->key, key, len) == 0)
+                return idx;
+        }
+        idx = (idx + 1) & mask;
+    }
+}
+
+// 动态调整哈希表大小, 使用槽位中保存的 hash, 不必重新计算
+static void hash_table_resize(cmd_hash_table_t* table, int new_size) {
+    cmd_hash_table_t new_table;
 
-    // 迁移所有节点到新桶数组
+    if (hash_table_init(&new_table, new_size))
+        return;
+
+    // 迁移所有槽位到新数组
     for (int i = 0; i < table->size; i++) {
-        cmd_node_t* node = table->buckets[i];
-        while (node) {
-            cmd_node_t* next = node->next;
-            // 在新桶中的位置
-            unsigned long idx = hash(node->path) % new_size;
-            node->next = new_buckets[idx];
-            new_buckets[idx] = node;
-            node = next;
-        }
+        if (table->tags[i] == CMD_HASH_TAG_EMPTY)
+            continue;
+        int idx = table->slots[i].hash & (new_size - 1);
+        while (new_table.tags[idx] != CMD_HASH_TAG_EMPTY)
+            idx = (idx + 1) & (new_size - 1);
+        new_table.tags[idx] = table->tags[i];
+        new_table.slots[idx] = table->slots[i];
     }
 
-    free(table->buckets);
-    table->buckets = new_buckets;
-    table->size = new_size;
+    new_table.count = table->count;
+    free(table->tags);
+    free(table->slots);
+    *table = new_table;
 }
 
-
-// 插入键值对（如果键存在则更新值）
-static void hash_table_set(void* t, const char* path, int cmd_index) {
+// 插入键值对（如果键存在则更新值）, key 不会被复制
+static void hash_table_set_n(void* t, const char* key, int len, int cmd_index) {
     cmd_hash_table_t* table = (cmd_hash_table_t*)t;
+    uint32_t h = cli_hash(key, len);
+    int idx;
+
     // 检查是否需要扩容
-    if ((float)table->count / table->size >= 0.75) {
+    if ((table->count + 1) * 4 > table->size * 3) {
         hash_table_resize(table, table->size * 2);
     }
 
-    unsigned long idx = hash(path) % table->size;
-    cmd_node_t* node = table->buckets[idx];
-
-    // 检查键是否已存在
-    while (node) {
-        if (strcmp(node->path, path) == 0) {
-            node->cmd_index = cmd_index; // 更新值
-            return;
-        }
-        node = node->next;
+    idx = hash_table_probe(table, key, len, h);
+    if (table->tags[idx] == CMD_HASH_TAG_EMPTY) {
+        table->tags[idx] = cmd_hash_tag(h);
+        table->slots[idx].key = key;
+        table->slots[idx].key_len = len;
+        table->slots[idx].hash = h;
+        table->count++;
     }
+    table->slots[idx].cmd_index = cmd_index;
+}
 
-    // 创建新节点
-    cmd_node_t* new_node = (cmd_node_t*)malloc(sizeof(cmd_node_t));
-    if (!new_node) return;
-    
-    new_node->path = strdup(path); // 复制字符串键
-    if (!new_node->path) {
-        free(new_node);
-        return;
-    }
-    new_node->cmd_index = cmd_index;
-    new_node->next = table->buckets[idx]; // 头插法
-    table->buckets[idx] = new_node;
-    table->count++;
+static void hash_table_set(void* t, const char* path, int cmd_index) {
+    hash_table_set_n(t, path, strlen(path), cmd_index);
+}
+
+// 查找键对应的值（成功返回1，失败返回0）, key 不需要以 '\0' 结尾
+static int hash_table_get_n(void* t, const char* key, int len, int* cmd_index) {
+    cmd_hash_table_t* table = (cmd_hash_table_t*)t;
+    int idx = hash_table_probe(table, key, len, cli_hash(key, len));
+
+    if (table->tags[idx] == CMD_HASH_TAG_EMPTY)
+        return 0; // 键不存在
+    *cmd_index = table->slots[idx].cmd_index;
+    return 1; // 查找成功
 }
 
-// 查找键对应的值（成功返回1，失败返回0）
 static int hash_table_get(void* t, const char* path, int* cmd_index) {
+    return hash_table_get_n(t, path, strlen(path), cmd_index);
+}
+
+// 清理哈希表内存, key 由调用者管理
+static void hash_table_destroy(cmd_hash_table_t* t) {
     cmd_hash_table_t* table = (cmd_hash_table_t*)t;
-    unsigned long idx = hash(path) % table->size;
-    cmd_node_t* node = table->buckets[idx];
-    
-    while (node) {
-        if (strcmp(node->path, path) == 0) {
-            *cmd_index = node->cmd_index;
-            return 1; // 查找成功
+    free(table->tags);
+    free(table->slots);
+    free(table);
+}
+
+/* arena 相关 */
+
+#define CLI_ARENA_ALIGN       16
+#define CLI_ARENA_BLOCK_SIZE  4096
+
+static cli_arena_block_t *cli_arena_block_create(int size)
+{
+    cli_arena_block_t *b = (cli_arena_block_t *)malloc(sizeof(cli_arena_block_t) + size);
+    if (!b)
+        return 0;
+    b->next = 0;
+    b->size = size;
+    b->used = 0;
+    b->last = -1;
+    return b;
+}
+
+void *cli_arena_alloc(cli_arena_t *a, int size)
+{
+    cli_arena_block_t *b = a->blocks;
+    int offset;
+
+    size = (size + CLI_ARENA_ALIGN - 1) & ~(CLI_ARENA_ALIGN - 1);
+    if (!b || b->used + size > b->size) {
+        /* 当前块放不下, 挂一个新块到链表头, 新块至少是原来的两倍 */
+        int block_size = b ? b->size << 1 : CLI_ARENA_BLOCK_SIZE;
+        while (block_size < size)
+            block_size <<= 1;
+        b = cli_arena_block_create(block_size);
+        if (!b)
+            return 0;
+        b->next = a->blocks;
+        a->blocks = b;
+    }
+
+    offset = b->used;
+    b->used += size;
+    b->last = offset;
+    return b->data + offset;
+}
+
+/* 如果 p 是最近一次分配且当前块还有空间, 则原地扩展, 否则重新分配并复制 */
+void *cli_arena_realloc(cli_arena_t *a, void *p, int old_size, int new_size)
+{
+    cli_arena_block_t *b = a->blocks;
+    void *n;
+
+    if (!p)
+        return cli_arena_alloc(a, new_size);
+
+    if (b && b->last >= 0 && (char *)p == b->data + b->last) {
+        int size = (new_size + CLI_ARENA_ALIGN - 1) & ~(CLI_ARENA_ALIGN - 1);
+        if (b->last + size <= b->size) {
+            b->used = b->last + size;
+            return p;
         }
-        node = node->next;
     }
-    return 0; // 键不存在
+
+    n = cli_arena_alloc(a, new_size);
+    if (n)
+        memcpy(n, p, old_size < new_size ? old_size : new_size);
+    return n;
 }
 
-// 清理哈希表内存
-static void hash_table_destroy(cmd_hash_table_t* t) {
-    cmd_hash_table_t* table = (cmd_hash_table_t*)t;
-    for (int i = 0; i < table->size; i++) {
-        cmd_node_t* node = table->buckets[i];
-        while (node) {
-            cmd_node_t* next = node->next;
-            free(node->path); // 释放键内存
-            free(node);
-            node = next;
+/*
+ * 回收 arena 中的所有内存.
+ * 如果上一个请求用到了多个块, 则把它们合并成一个足够大的块,
+ * 这样稳定状态下每个请求只在一个块里 bump 分配, 不再 malloc/free.
+ */
+void cli_arena_reset(cli_arena_t *a)
+{
+    cli_arena_block_t *b = a->blocks;
+    int total = 0;
+
+    if (!b)
+        return;
+
+    if (b->next) {
+        while (b) {
+            cli_arena_block_t *next = b->next;
+            total += b->size;
+            free(b);
+            b = next;
         }
+        a->blocks = cli_arena_block_create(total);
+        return;
     }
-    free(table->buckets);
-    free(table);
+
+    b->used = 0;
+    b->last = -1;
+}
+
+void *cli_ctx_alloc(cli_ctx_t *ctx, int size)
+{
+    return cli_arena_alloc(ctx->arena, size);
 }
 
 /* bitmap 相关 */
+
+/* bitmap 数据实际存放的位置 */
+inline __attribute__((always_inline)) uint64_t *cli_bitmap_words (bitmap_t *ai)
+{
+    return ai->capacity ? ai->bitmap : ai->inline_bitmap;
+}
+
+inline __attribute__((always_inline)) void cli_bitmap_init (bitmap_t *ai)
+{
+    memset (ai, 0, sizeof (bitmap_t));
+    ai->max_valid_index = -1;
+}
+
+/* 使用调用者提供的 n 个 word 作为存储, 只有容量不够时才会转到堆上 */
+inline __attribute__((always_inline)) void
+cli_bitmap_init_scratch (bitmap_t *ai, uint64_t *words, int n)
+{
+    cli_bitmap_init (ai);
+    if (words && n > CLI_BITMAP_INLINE_WORDS) {
+        ai->bitmap = words;
+        ai->capacity = n;
+        ai->is_scratch = 1;
+    }
+}
+
+/* 确保 bitmap 至少可以容纳 n 个 word, 已有数据保留, 新增部分不做初始化 */
+inline __attribute__((always_inline)) void cli_bitmap_validate (bitmap_t *ai, int n)
+{
+    uint64_t *words;
+    int capacity = ai->capacity ? ai->capacity : CLI_BITMAP_INLINE_WORDS;
+
+    if (n <= capacity)
+        return;
+
+    capacity = capacity << 1;
+    if (capacity < n)
+        capacity = n;
+    words = (uint64_t *)malloc(capacity * sizeof(uint64_t));
+    memcpy(words, cli_bitmap_words (ai), (ai->max_valid_index + 1) * sizeof(uint64_t));
+    if (ai->capacity && !ai->is_scratch)
+        free(ai->bitmap);
+    ai->bitmap = words;
+    ai->capacity = capacity;
+    ai->is_scratch = 0;
+}
+
+/* 释放 bitmap 自己在堆上持有的存储, 结构体本身由调用者管理 */
+inline __attribute__((always_inline)) void cli_bitmap_release (bitmap_t *ai)
+{
+    if (ai->capacity && !ai->is_scratch)
+        free(ai->bitmap);
+    cli_bitmap_init (ai);
+}
+
 #define _(name, body)			\
  inline __attribute__((always_inline)) bitmap_t *	\
  cli_bitmap_##name (bitmap_t* ai, uint32_t i)		\
  {							\
-    int i0 = i / 32;		\
-    int i1 = i % 32;		\
-    uint32_t a, b;						\
+    int i0 = i / 64;		\
+    int i1 = i % 64;		\
+    uint64_t a, b, *words;						\
     if (ai->max_valid_index < i0) {                         \
-        ai->bitmap = realloc(ai->bitmap, (i0 + 1) * sizeof(uint32_t)); \
+        cli_bitmap_validate (ai, i0 + 1);                              \
+        words = cli_bitmap_words (ai);                                 \
         for (int j = i0; j > ai->max_valid_index; j--)                 \
-           ai->bitmap[j] = 0;                                          \
+           words[j] = 0;                                               \
         ai->max_valid_index = i0;                                      \
     }                                                             \
-    a = ai->bitmap[i0];						        \
-    b = (uint32_t) 1 << i1;					\
+    words = cli_bitmap_words (ai);                                \
+    a = words[i0];						        \
+    b = (uint64_t) 1 << i1;					\
     do { body; } while (0);				    \
-    ai->bitmap[i0] = a;						\
+    words[i0] = a;						\
     return ai;						\
  }
  
@@ -169,36 +368,273 @@ static void hash_table_destroy(cmd_hash_table_t* t) {
  _(xori, a = a ^ b)
 #undef _
 
-/* ALU function definition macro for functions taking two bitmaps. */
-#define _(name, body)                                             \
+/*
+ * bitmap 运算内核, 以 64 位 word 为单位处理.
+ * 每种运算都有 scalar / SSE4.2 / AVX2 三份实现, cli_bitmap_kernels_init 按 CPU 能力选择.
+ * xxx_count 版本在同一趟扫描中完成运算和 popcount, 返回结果中置位的 bit 数,
+ * 结果为 0 即代表 bitmap 为空, 不必再扫描一遍.
+ */
+#define foreach_cli_bitmap_op                                   \
+  _(and, a & b, _mm_and_si128 (a, b), _mm256_and_si256 (a, b))   \
+  _(andnot, a & ~b, _mm_andnot_si128 (b, a), _mm256_andnot_si256 (b, a)) \
+  _(or, a | b, _mm_or_si128 (a, b), _mm256_or_si256 (a, b))      \
+  _(xor, a ^ b, _mm_xor_si128 (a, b), _mm256_xor_si256 (a, b))
+
+typedef void (cli_bitmap_op_fn_t) (uint64_t *ap, const uint64_t *bp, int n);
+typedef int (cli_bitmap_op_count_fn_t) (uint64_t *ap, const uint64_t *bp, int n);
+
+typedef struct {
+#define _(name, s, v128, v256)                  \
+    cli_bitmap_op_fn_t *name;                   \
+    cli_bitmap_op_count_fn_t *name##_count;
+    foreach_cli_bitmap_op
+#undef _
+    int (*count) (const uint64_t *ap, int n);
+    int (*first_set) (const uint64_t *ap, int n);
+} cli_bitmap_kernels_t;
+
+#define _(name, s, v128, v256)                                               \
+static void cli_bitmap_##name##_scalar (uint64_t *ap, const uint64_t *bp, int n) \
+{                                                                            \
+    for (int i = 0; i < n; i++) {                                            \
+        uint64_t a = ap[i], b = bp[i];                                       \
+        ap[i] = s;                                                           \
+    }                                                                        \
+}                                                                            \
+static int cli_bitmap_##name##_count_scalar (uint64_t *ap, const uint64_t *bp, int n) \
+{                                                                            \
+    int n_set = 0;                                                           \
+    for (int i = 0; i < n; i++) {                                            \
+        uint64_t a = ap[i], b = bp[i];                                       \
+        ap[i] = s;                                                           \
+        n_set += __builtin_popcountll (ap[i]);                               \
+    }                                                                        \
+    return n_set;                                                            \
+}
+foreach_cli_bitmap_op
+#undef _
+
+static int cli_bitmap_count_scalar (const uint64_t *ap, int n)
+{
+    int n_set = 0;
+    for (int i = 0; i < n; i++)
+        n_set += __builtin_popcountll (ap[i]);
+    return n_set;
+}
+
+static int cli_bitmap_first_set_scalar (const uint64_t *ap, int n)
+{
+    for (int i = 0; i < n; i++)
+        if (ap[i] != 0)
+            return i * 64 + __builtin_ctzll (ap[i]);
+    return ~0;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+/* SSE4.2: 一次处理 2 个 word, popcount 使用 POPCNT 指令 */
+#define _(name, s, v128, v256)                                               \
+__attribute__((target("sse4.2,popcnt")))                                    \
+static void cli_bitmap_##name##_sse42 (uint64_t *ap, const uint64_t *bp, int n) \
+{                                                                            \
+    int i = 0;                                                               \
+    for (; i + 2 <= n; i += 2) {                                             \
+        __m128i a = _mm_loadu_si128 ((const __m128i *)(ap + i));             \
+        __m128i b = _mm_loadu_si128 ((const __m128i *)(bp + i));             \
+        _mm_storeu_si128 ((__m128i *)(ap + i), v128);                        \
+    }                                                                        \
+    cli_bitmap_##name##_scalar (ap + i, bp + i, n - i);                      \
+}                                                                            \
+__attribute__((target("sse4.2,popcnt")))                                    \
+static int cli_bitmap_##name##_count_sse42 (uint64_t *ap, const uint64_t *bp, int n) \
+{                                                                            \
+    int i = 0, n_set = 0;                                                    \
+    for (; i + 2 <= n; i += 2) {                                             \
+        __m128i a = _mm_loadu_si128 ((const __m128i *)(ap + i));             \
+        __m128i b = _mm_loadu_si128 ((const __m128i *)(bp + i));             \
+        __m128i r = v128;                                                    \
+        _mm_storeu_si128 ((__m128i *)(ap + i), r);                           \
+        n_set += _mm_popcnt_u64 (_mm_cvtsi128_si64 (r))                      \
+               + _mm_popcnt_u64 (_mm_extract_epi64 (r, 1));                  \
+    }                                                                        \
+    for (; i < n; i++) {                                                     \
+        uint64_t a = ap[i], b = bp[i];                                       \
+        ap[i] = s;                                                           \
+        n_set += _mm_popcnt_u64 (ap[i]);                                     \
+    }                                                                        \
+    return n_set;                                                            \
+}
+foreach_cli_bitmap_op
+#undef _
+
+__attribute__((target("sse4.2,popcnt")))
+static int cli_bitmap_count_sse42 (const uint64_t *ap, int n)
+{
+    int n_set = 0;
+    for (int i = 0; i < n; i++)
+        n_set += _mm_popcnt_u64 (ap[i]);
+    return n_set;
+}
+
+__attribute__((target("sse4.2,popcnt")))
+static int cli_bitmap_first_set_sse42 (const uint64_t *ap, int n)
+{
+    int i = 0, r;
+    for (; i + 2 <= n; i += 2) {
+        __m128i a = _mm_loadu_si128 ((const __m128i *)(ap + i));
+        if (!_mm_testz_si128 (a, a))
+            break;
+    }
+    r = cli_bitmap_first_set_scalar (ap + i, n - i);
+    return r == ~0 ? ~0 : i * 64 + r;
+}
+
+/* AVX2 没有向量 popcount 指令, 用查表法: 每个字节拆成高低两个 nibble 查 vpshufb, 再用 vpsadbw 累加到 4 个 64 位 lane */
+__attribute__((target("avx2")))
+static inline __m256i cli_bitmap_popcount256 (__m256i v)
+{
+    const __m256i lookup = _mm256_setr_epi8 (0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                             0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_mask = _mm256_set1_epi8 (0x0f);
+    __m256i lo = _mm256_and_si256 (v, low_mask);
+    __m256i hi = _mm256_and_si256 (_mm256_srli_epi16 (v, 4), low_mask);
+    __m256i cnt = _mm256_add_epi8 (_mm256_shuffle_epi8 (lookup, lo),
+                                   _mm256_shuffle_epi8 (lookup, hi));
+    return _mm256_sad_epu8 (cnt, _mm256_setzero_si256 ());
+}
+
+__attribute__((target("avx2")))
+static inline int cli_bitmap_hsum256 (__m256i acc)
+{
+    __m128i s = _mm_add_epi64 (_mm256_castsi256_si128 (acc),
+                               _mm256_extracti128_si256 (acc, 1));
+    return _mm_cvtsi128_si64 (s) + _mm_extract_epi64 (s, 1);
+}
+
+/* AVX2: 一次处理 4 个 word */
+#define _(name, s, v128, v256)                                               \
+__attribute__((target("avx2,popcnt")))                                      \
+static void cli_bitmap_##name##_avx2 (uint64_t *ap, const uint64_t *bp, int n) \
+{                                                                            \
+    int i = 0;                                                               \
+    for (; i + 4 <= n; i += 4) {                                             \
+        __m256i a = _mm256_loadu_si256 ((const __m256i *)(ap + i));          \
+        __m256i b = _mm256_loadu_si256 ((const __m256i *)(bp + i));          \
+        _mm256_storeu_si256 ((__m256i *)(ap + i), v256);                     \
+    }                                                                        \
+    cli_bitmap_##name##_scalar (ap + i, bp + i, n - i);                      \
+}                                                                            \
+__attribute__((target("avx2,popcnt")))                                      \
+static int cli_bitmap_##name##_count_avx2 (uint64_t *ap, const uint64_t *bp, int n) \
+{                                                                            \
+    int i = 0;                                                               \
+    __m256i acc = _mm256_setzero_si256 ();                                   \
+    for (; i + 4 <= n; i += 4) {                                             \
+        __m256i a = _mm256_loadu_si256 ((const __m256i *)(ap + i));          \
+        __m256i b = _mm256_loadu_si256 ((const __m256i *)(bp + i));          \
+        __m256i r = v256;                                                    \
+        _mm256_storeu_si256 ((__m256i *)(ap + i), r);                        \
+        acc = _mm256_add_epi64 (acc, cli_bitmap_popcount256 (r));            \
+    }                                                                        \
+    return cli_bitmap_hsum256 (acc)                                          \
+         + cli_bitmap_##name##_count_scalar (ap + i, bp + i, n - i);         \
+}
+foreach_cli_bitmap_op
+#undef _
+
+__attribute__((target("avx2,popcnt")))
+static int cli_bitmap_count_avx2 (const uint64_t *ap, int n)
+{
+    int i = 0;
+    __m256i acc = _mm256_setzero_si256 ();
+    for (; i + 4 <= n; i += 4)
+        acc = _mm256_add_epi64 (acc, cli_bitmap_popcount256 (
+                  _mm256_loadu_si256 ((const __m256i *)(ap + i))));
+    return cli_bitmap_hsum256 (acc) + cli_bitmap_count_scalar (ap + i, n - i);
+}
+
+__attribute__((target("avx2,popcnt")))
+static int cli_bitmap_first_set_avx2 (const uint64_t *ap, int n)
+{
+    int i = 0, r;
+    for (; i + 4 <= n; i += 4) {
+        __m256i a = _mm256_loadu_si256 ((const __m256i *)(ap + i));
+        if (!_mm256_testz_si256 (a, a))
+            break;
+    }
+    r = cli_bitmap_first_set_scalar (ap + i, n - i);
+    return r == ~0 ? ~0 : i * 64 + r;
+}
+#endif
+
+#define _(name, s, v128, v256) .name = cli_bitmap_##name##_scalar, .name##_count = cli_bitmap_##name##_count_scalar,
+cli_bitmap_kernels_t cli_bitmap_kernels = {
+    foreach_cli_bitmap_op
+    .count = cli_bitmap_count_scalar,
+    .first_set = cli_bitmap_first_set_scalar,
+};
+#undef _
+
+/* 根据 CPU 支持的指令集选择 bitmap 运算内核 */
+static void cli_bitmap_kernels_init()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init ();
+    if (__builtin_cpu_supports ("avx2") && __builtin_cpu_supports ("popcnt")) {
+#define _(name, s, v128, v256)                                        \
+        cli_bitmap_kernels.name = cli_bitmap_##name##_avx2;          \
+        cli_bitmap_kernels.name##_count = cli_bitmap_##name##_count_avx2;
+        foreach_cli_bitmap_op
+#undef _
+        cli_bitmap_kernels.count = cli_bitmap_count_avx2;
+        cli_bitmap_kernels.first_set = cli_bitmap_first_set_avx2;
+    } else if (__builtin_cpu_supports ("sse4.2") && __builtin_cpu_supports ("popcnt")) {
+#define _(name, s, v128, v256)                                        \
+        cli_bitmap_kernels.name = cli_bitmap_##name##_sse42;         \
+        cli_bitmap_kernels.name##_count = cli_bitmap_##name##_count_sse42;
+        foreach_cli_bitmap_op
+#undef _
+        cli_bitmap_kernels.count = cli_bitmap_count_sse42;
+        cli_bitmap_kernels.first_set = cli_bitmap_first_set_sse42;
+    }
+#endif
+}
+
+/*
+ * 两个 bitmap 之间的运算, 结果写回 ai.
+ * and / andnot 的结果不会比 ai 长, 因此 ai 不需要扩容; or / xor 需要把 ai 扩到 bi 的长度.
+ */
+#define _(name, grow, clear_tail)                                                     \
 inline __attribute__((always_inline)) bitmap_t *cli_bitmap_##name (bitmap_t *ai, bitmap_t *bi)  \
   {                                                                           \
-    int i;                                                                    \
-    uint32_t a, b;                                                            \
+    int i, n;                                                                 \
     int ai_len, bi_len;                                                       \
+    uint64_t *a;                                                              \
     ai_len = ai->max_valid_index + 1;                                         \
     bi_len = bi->max_valid_index + 1;                                         \
-    if (bi_len > 0 && ai_len < bi_len) {                                       \
-        ai->bitmap = realloc(ai->bitmap, (bi_len) * sizeof(uint32_t));        \
+    if (grow && ai_len < bi_len) {                                            \
+        cli_bitmap_validate (ai, bi_len);                                     \
+        a = cli_bitmap_words (ai);                                            \
+        for (i = ai_len; i < bi_len; i++)                                     \
+            a[i] = 0;                                                         \
         ai->max_valid_index = bi_len - 1;                                     \
-        ai_len = ai->max_valid_index + 1;                                     \
-    }                                                                         \
-    for (i = 0; i < ai_len; i++) {                                            \
-        a = ai->bitmap[i];                                                    \
-	    b = i < bi_len ? bi->bitmap[i] : 0;                                   \
-	    do {                                                                  \
-	        body;                                                             \
-	    } while (0);                                                          \
-	    ai->bitmap[i] = a;                                                    \
+        ai_len = bi_len;                                                      \
     }                                                                         \
+    a = cli_bitmap_words (ai);                                                \
+    n = ai_len < bi_len ? ai_len : bi_len;                                    \
+    cli_bitmap_kernels.name (a, cli_bitmap_words (bi), n);                    \
+    if (clear_tail)                                                           \
+        for (i = n; i < ai_len; i++)                                          \
+            a[i] = 0;                                                         \
     return ai;                                                                \
 }                                                                         
 
 /* ALU functions: */
-_(and, a = a & b)
-_(andnot, a = a & ~b)
-_(or, a = a | b)
-_(xor, a = a ^ b)
+_(and, 0, 1)
+_(andnot, 0, 0)
+_(or, 1, 0)
+_(xor, 1, 0)
 #undef _
 
 /** Return the number of set bits in a bitmap
@@ -207,35 +643,62 @@ _(xor, a = a ^ b)
 */
 inline __attribute__((always_inline)) int cli_bitmap_count_set_bits (bitmap_t * ai)
 {
-    int i;
-    int n_set = 0;
+    if (ai)
+        return cli_bitmap_kernels.count (cli_bitmap_words (ai), ai->max_valid_index + 1);
+    return 0;
+}
 
-    if (ai) {
-        for (i = 0; i < ai->max_valid_index + 1; i++)
-            n_set += __builtin_popcount (ai->bitmap[i]);
-    }
-    
-    return n_set;
+/* ai &= bi, 同时返回结果中置位的 bit 数 */
+inline __attribute__((always_inline)) int cli_bitmap_and_count (bitmap_t *ai, bitmap_t *bi)
+{
+    int i, n, ai_len, bi_len;
+    uint64_t *a = cli_bitmap_words (ai);
+
+    ai_len = ai->max_valid_index + 1;
+    bi_len = bi->max_valid_index + 1;
+    n = ai_len < bi_len ? ai_len : bi_len;
+    for (i = n; i < ai_len; i++)
+        a[i] = 0;
+    return cli_bitmap_kernels.and_count (a, cli_bitmap_words (bi), n);
+}
+
+/* ai &= ~bi, 同时返回结果中置位的 bit 数 */
+inline __attribute__((always_inline)) int cli_bitmap_andnot_count (bitmap_t *ai, bitmap_t *bi)
+{
+    int n, ai_len, bi_len;
+    uint64_t *a = cli_bitmap_words (ai);
+
+    ai_len = ai->max_valid_index + 1;
+    bi_len = bi->max_valid_index + 1;
+    n = ai_len < bi_len ? ai_len : bi_len;
+    return cli_bitmap_kernels.andnot_count (a, cli_bitmap_words (bi), n)
+         + cli_bitmap_kernels.count (a + n, ai_len - n);
 }
 
 inline __attribute__((always_inline)) void cli_bitmap_free (bitmap_t * ai)
 {
     if (ai) {
-        free(ai->bitmap);
+        cli_bitmap_release (ai);
         free(ai);
     }
 }
 
+/* 把 bi 的内容复制到 ai 已有的存储中, 存储足够时不分配内存 */
+inline __attribute__((always_inline)) bitmap_t* cli_bitmap_copy (bitmap_t *ai, bitmap_t *bi)
+{
+    cli_bitmap_validate (ai, bi->max_valid_index + 1);
+    memcpy(cli_bitmap_words (ai), cli_bitmap_words (bi), (bi->max_valid_index + 1) * sizeof(uint64_t));
+    ai->max_valid_index = bi->max_valid_index;
+    return ai;
+}
+
 inline __attribute__((always_inline)) bitmap_t* cli_bitmap_dup (bitmap_t * ai)
 {
     bitmap_t* result = 0;
     if (ai) {
         result = (bitmap_t*)malloc(sizeof(bitmap_t));
-        result->bitmap = (uint32_t*)malloc((ai->max_valid_index + 1) * sizeof(uint32_t));
-        result->max_valid_index = ai->max_valid_index;
-        for (int i = 0; i <= result->max_valid_index; i++) {
-            result->bitmap[i] = ai->bitmap[i];
-        }
+        cli_bitmap_init (result);
+        cli_bitmap_copy (result, ai);
     }
 
     return result;
@@ -243,23 +706,14 @@ inline __attribute__((always_inline)) bitmap_t* cli_bitmap_dup (bitmap_t * ai)
 
 inline __attribute__((always_inline)) int cli_bitmap_is_zero (bitmap_t * ai)
 {
-    int i;
-    for (i = 0; i < (ai->max_valid_index + 1); i++)
-        if (ai->bitmap[i] != 0)
-            return 0;
-    return 1;
+    return cli_bitmap_kernels.first_set (cli_bitmap_words (ai), ai->max_valid_index + 1) == ~0;
 }
 
 /* 获取 bitmap 中首个置位的 bit, 如果没有的话, 则返回 ~0 */
 inline __attribute__((always_inline)) int 
 cli_bitmap_first_set (bitmap_t * ai)
 {
-    for (int i = 0; i < (ai->max_valid_index + 1); i++) {
-        uint32_t x = ai->bitmap[i];
-        if (x != 0)
-            return i * 32 + __builtin_ctz(x);
-    }
-    return ~0;
+    return cli_bitmap_kernels.first_set (cli_bitmap_words (ai), ai->max_valid_index + 1);
 }
 
 inline __attribute__((always_inline)) char unformat_get_input (cli_ctx_t * ctx)
@@ -646,7 +1100,7 @@ parse_fail:
 /*
  * 使用 fmt 尝试格式化 ctx 输入 
  */
-int unformat (cli_ctx_t* ctx, const char *fmt, ...)
+int (unformat) (cli_ctx_t* ctx, const char *fmt, ...)
 {
     va_list va;
     int result;
@@ -656,80 +1110,1078 @@ int unformat (cli_ctx_t* ctx, const char *fmt, ...)
     return result;
 }
 
-// static void cli_output(cli_ctx_t* ctx, char* output) {
-void cli_output(cli_ctx_t* ctx, int new_line, char* fmt, ...) 
+/*
+ * unformat 程序: 把格式字符串预先编译成一串操作, 执行时不再逐字符解释格式字符串.
+ * 编译过程完全按照 va_unformat 的流程走一遍格式字符串, 只是把动作记录下来,
+ * 因此执行结果与 va_unformat 完全一致.
+ */
+typedef enum {
+    /* 跳过输入中的空白 */
+    UNFORMAT_OP_SKIP_WHITE_SPACE,
+    /* 输入必须与格式中的一段字面量完全相同 */
+    UNFORMAT_OP_LITERAL,
+    /* %d %u %x ... 整数转换 */
+    UNFORMAT_OP_INTEGER,
+    /* 格式字符串结束, 匹配成功 */
+    UNFORMAT_OP_END,
+    /* 格式字符串本身无法匹配任何输入 */
+    UNFORMAT_OP_FAIL,
+} unformat_op_type_t;
+
+typedef struct {
+    uint8_t type;
+    /* UNFORMAT_OP_END: 要求前面刚刚跳过了空白 */
+    uint8_t require_white_space;
+    /* UNFORMAT_OP_INTEGER */
+    uint8_t base;
+    uint8_t is_signed;
+    /* 整数宽度从参数中获取(%D %X) */
+    uint8_t data_bytes_from_arg;
+    uint32_t data_bytes;
+    /* UNFORMAT_OP_LITERAL */
+    const char *literal;
+    int literal_len;
+} unformat_op_t;
+
+struct cli_unformat_program_t {
+    const char *fmt;
+    int n_ops;
+    unformat_op_t ops[];
+};
+
+static void unformat_program_add(unformat_op_t *ops, int *n_ops, unformat_op_t *op)
 {
-    va_list args;
-    int needed;
+    ops[(*n_ops)++] = *op;
+}
 
-    va_start(args, fmt);
-    needed = vsnprintf(NULL, 0, fmt, args);
-    va_end(args);
-    
-    if (ctx->output_index == 0) {
-        /* 如果没有输出过任何内容, 则不必设置为新行 */
-        new_line = 0;
-    }
+/* 与 do_percent 的格式解析一致, 返回转换字符之后的位置, 无法识别的转换返回 0 */
+static const char *unformat_compile_percent(const char *f, unformat_op_t *op)
+{
+    char cf;
 
-    if (new_line) {
-        needed++;
-    }
-    int new_size = ctx->output_index + 1 + needed;
-    while (new_size > ctx->output_capacity) {
-        ctx->output_capacity << 1;
-        ctx->output_buffer = (char*)realloc(ctx->output_buffer, ctx->output_capacity);
-    }
+    memset(op, 0, sizeof(*op));
+    op->type = UNFORMAT_OP_INTEGER;
+    op->data_bytes = ~0;
 
-    if (new_line) {
-        ctx->output_buffer[ctx->output_index] = '\n';
-        ctx->output_index++;
-    }
+    cf = *f++;
+    switch (cf) {
+        default:
+            break;
 
-    va_start(args, fmt);
-    vsnprintf(ctx->output_buffer + ctx->output_index, 
-              ctx->output_capacity - ctx->output_index,
-              fmt, args);
-    va_end(args);
+        case 'w':
+            cf = *f++;
+            op->data_bytes = sizeof (uint32_t);
+            break;
 
-    ctx->output_index += needed;
-    if (new_line) {
-        ctx->output_index--;
+        case 'l':
+            cf = *f++;
+            if (cf == 'l') {
+                cf = *f++;
+                op->data_bytes = sizeof (long long);
+            } else {
+                op->data_bytes = sizeof (long);
+            }
+            break;
+        case 'L':
+            cf = *f++;
+            op->data_bytes = sizeof (long long);
+            break;
     }
 
-    return;
-}
-
-void cli_normalize_str(char *input, char **result) {
-    // 处理输入为NULL或空字符串的情况
-    if (input == NULL || *input == '\0') {
-        *result = strdup("");
-        return;
+    switch (cf) {
+        case 'D':
+            op->data_bytes_from_arg = 1;
+        case 'd':
+            op->base = 10;
+            op->is_signed = UNFORMAT_INTEGER_SIGNED;
+            break;
+        case 'u':
+            op->base = 10;
+            break;
+        case 'b':
+            op->base = 2;
+            break;
+        case 'o':
+            op->base = 8;
+            break;
+        case 'X':
+            op->data_bytes_from_arg = 1;
+        case 'x':
+            op->base = 16;
+            break;
+        default:
+            return 0;
     }
 
-    // 分配足够的内存
-    char *output = (char *)malloc(strlen(input) + 1);
-    if (output == NULL) {
-        *result = NULL;
-        return;
-    }
+    return f;
+}
 
-    char *src = input;   // 源指针遍历输入
-    char *dst = output;  // 目标指针写入输出
-    int in_space = 0;    // 标记是否在空格序列中
-    int has_content = 0; // 标记是否有非空格内容
+static cli_unformat_program_t *unformat_compile(const char *fmt)
+{
+    cli_unformat_program_t *p;
+    unformat_op_t op;
+    const char *f = fmt;
+    int n_ops = 0;
+
+    /* 每轮循环最多产生 2 个操作, 每轮至少消耗 1 个格式字符 */
+    p = (cli_unformat_program_t *)malloc(sizeof(*p) + (2 * strlen(fmt) + 2) * sizeof(unformat_op_t));
+    if (!p)
+        return 0;
+    p->fmt = fmt;
 
-    // 跳过开头的空白字符
-    while (*src != '\0' && isspace((unsigned char)*src)) {
-        src++;
-    }
+    while (1) {
+        char cf;
+        int is_percent, skip_input_white_space;
 
-    // 处理字符串主体
-    while (*src != '\0') {
+        cf = *f;
+        is_percent = 0;
+        skip_input_white_space = f == fmt;
+
+        if (is_white_space (cf)) {
+            skip_input_white_space = 1;
+            while (is_white_space (*++f))
+                ;
+        } else if (cf == '%') {
+            switch (*++f) {
+                case '%':
+                    break;
+                case 0:
+                    goto fail;
+                default:
+                    is_percent = 1;
+                    break;
+            }
+        }
+
+        memset(&op, 0, sizeof(op));
+        if (skip_input_white_space) {
+            op.type = UNFORMAT_OP_SKIP_WHITE_SPACE;
+            unformat_program_add(p->ops, &n_ops, &op);
+        }
+
+        if (cf == 0) {
+            op.type = UNFORMAT_OP_END;
+            op.require_white_space = skip_input_white_space;
+            unformat_program_add(p->ops, &n_ops, &op);
+            break;
+        }
+
+        if (is_percent) {
+            if (!(f = unformat_compile_percent(f, &op)))
+                goto fail;
+            unformat_program_add(p->ops, &n_ops, &op);
+        } else {
+            const char *g = f;
+            while (*g != 0 && *g != '%' && *g != ' ')
+                g++;
+            if (g != f) {
+                op.type = UNFORMAT_OP_LITERAL;
+                op.literal = f;
+                op.literal_len = g - f;
+                unformat_program_add(p->ops, &n_ops, &op);
+            }
+            f = g;
+        }
+    }
+
+    p->n_ops = n_ops;
+    return (cli_unformat_program_t *)realloc(p, sizeof(*p) + n_ops * sizeof(unformat_op_t));
+
+fail:
+    memset(&op, 0, sizeof(op));
+    op.type = UNFORMAT_OP_FAIL;
+    unformat_program_add(p->ops, &n_ops, &op);
+    p->n_ops = n_ops;
+    return p;
+}
+
+/*
+ * 十进制整数的快速路径, 语义与 unformat_integer (base 10) 完全一致,
+ * 只是直接扫描 buffer, 不再逐字符 get/put.
+ */
+static inline __attribute__((always_inline)) int
+unformat_program_decimal (cli_ctx_t *ctx, va_list *va, int is_signed, uint32_t data_bytes)
+{
+    const char *in = ctx->buffer;
+    int i = ctx->index, len = ctx->len;
+    int value = 0, n_digits = 0, sign = 0;
+    void *v;
+
+    if (i < len && (in[i] == '-' || in[i] == '+')) {
+        if (in[i] == '-') {
+            if (!is_signed)
+                return 0;
+            sign = 1;
+        }
+        i++;
+    }
+
+    for (; i < len; i++) {
+        char c = in[i];
+        int new_value;
+
+        if (c < '0' || c > '9') {
+            /* 与 unformat_get_input 一致: 字节 0xff 被当作输入结束并被消耗 */
+            if (c == (char)-1)
+                i++;
+            break;
+        }
+        new_value = 10 * value + (c - '0');
+        if (new_value < value)
+            return 0;
+        value = new_value;
+        n_digits++;
+    }
+    ctx->index = i;
+
+    if (n_digits == 0)
+        return 0;
+    if (sign)
+        value = -value;
+
+    v = va_arg (*va, void *);
+    switch (data_bytes) {
+        case ~0u:
+        case 4:
+            *(uint32_t *) v = value;
+            break;
+        case 1:
+            *(uint8_t *) v = value;
+            break;
+        case 2:
+            *(uint16_t *) v = value;
+            break;
+        case 8:
+            *(uint64_t *) v = value;
+            break;
+        default:
+            return 0;
+    }
+    return 1;
+}
+
+static int unformat_program_run(cli_ctx_t *ctx, cli_unformat_program_t *p, va_list *va)
+{
+    int input_index_save = ctx->index;
+    int n_input_white_space_skipped = 0;
+    unformat_op_t *op;
+
+    for (op = p->ops; op < p->ops + p->n_ops; op++) {
+        switch (op->type) {
+            case UNFORMAT_OP_SKIP_WHITE_SPACE:
+                n_input_white_space_skipped = unformat_skip_white_space (ctx);
+                break;
+
+            case UNFORMAT_OP_LITERAL: {
+                const char *in = ctx->buffer + ctx->index;
+                int i;
+                if (ctx->index + op->literal_len > ctx->len)
+                    goto parse_fail;
+                for (i = 0; i < op->literal_len; i++)
+                    if (in[i] != op->literal[i])
+                        goto parse_fail;
+                ctx->index += op->literal_len;
+                break;
+            }
+
+            case UNFORMAT_OP_INTEGER: {
+                uint32_t data_bytes = op->data_bytes;
+                if (op->data_bytes_from_arg)
+                    data_bytes = va_arg (*va, int);
+                if (op->base == 10) {
+                    if (!unformat_program_decimal (ctx, va, op->is_signed, data_bytes))
+                        goto parse_fail;
+                    break;
+                }
+                if (!unformat_integer (ctx, va, op->base, op->is_signed, data_bytes))
+                    goto parse_fail;
+                break;
+            }
+
+            case UNFORMAT_OP_END:
+                if (op->require_white_space && n_input_white_space_skipped == 0)
+                    goto parse_fail;
+                return 1;
+
+            default:
+                goto parse_fail;
+        }
+    }
+
+parse_fail:
+    ctx->index = input_index_save;
+    return 0;
+}
+
+/*
+ * 使用缓存的 unformat 程序解析输入, *program 为调用点的缓存槽位.
+ * 缓存以 fmt 的地址为 key, 第一次调用(或 fmt 地址变化)时编译.
+ */
+int unformat_cached (cli_ctx_t* ctx, cli_unformat_program_t **program, const char *fmt, ...)
+{
+    cli_unformat_program_t *p = __atomic_load_n (program, __ATOMIC_ACQUIRE);
+    va_list va;
+    int result;
+
+    if (!p || p->fmt != fmt) {
+        p = unformat_compile (fmt);
+        if (!p) {
+            va_start (va, fmt);
+            result = va_unformat (ctx, fmt, &va);
+            va_end (va);
+            return result;
+        }
+        __atomic_store_n (program, p, __ATOMIC_RELEASE);
+    }
+
+    va_start (va, fmt);
+    result = unformat_program_run (ctx, p, &va);
+    va_end (va);
+    return result;
+}
+
+/* 输出相关 */
+
+/*
+ * 段从当前线程的空闲链表分配, 也放回当前线程的空闲链表.
+ * 工作线程产生的段由 I/O 线程发送后释放, 所以每个线程的链表都有上限, 多出来的还给 malloc.
+ */
+static cli_output_segment_t *cli_output_segment_alloc(void)
+{
+    cli_thread_t *t = cli_thread_self();
+    cli_output_segment_t *s = t->output_free_segments;
+
+    if (s) {
+        t->output_free_segments = s->next;
+        t->output_free_count--;
+    } else if (!(s = (cli_output_segment_t *) malloc(sizeof(*s))))
+        return 0;
+
+    s->next = 0;
+    s->start = s->len = 0;
+    return s;
+}
+
+static void cli_output_segment_free(cli_output_segment_t *s)
+{
+    cli_thread_t *t = cli_thread_self();
+
+    if (t->output_free_count >= CLI_OUTPUT_FREE_MAX) {
+        free(s);
+        return;
+    }
+    s->next = t->output_free_segments;
+    t->output_free_segments = s;
+    t->output_free_count++;
+}
+
+/* 在队列尾部追加一个空段 */
+static cli_output_segment_t *cli_output_segment_append(cli_output_queue_t *q)
+{
+    cli_output_segment_t *s = cli_output_segment_alloc();
+
+    if (!s) {
+        q->error = 1;
+        return 0;
+    }
+
+    if (q->tail)
+        q->tail->next = s;
+    else
+        q->head = s;
+    q->tail = s;
+
+    return s;
+}
+
+void cli_output_queue_discard(cli_output_queue_t *q)
+{
+    cli_output_segment_t *s, *next;
+
+    for (s = q->head; s; s = next) {
+        next = s->next;
+        cli_output_segment_free(s);
+    }
+    q->head = q->tail = 0;
+    q->pending = 0;
+}
+
+void cli_output_queue_consume(cli_output_queue_t *q, int n)
+{
+    cli_output_segment_t *s;
+    int k;
+
+    q->pending -= n;
+    while ((s = q->head)) {
+        k = s->len - s->start;
+        if (n < k) {
+            s->start += n;
+            break;
+        }
+        n -= k;
+        q->head = s->next;
+        if (!q->head)
+            q->tail = 0;
+        cli_output_segment_free(s);
+    }
+}
+
+void cli_output_queue_splice(cli_output_queue_t *to, cli_output_queue_t *from)
+{
+    if (!from->head)
+        return;
+
+    if (to->tail)
+        to->tail->next = from->head;
+    else
+        to->head = from->head;
+    to->tail = from->tail;
+    to->pending += from->pending;
+
+    from->head = from->tail = 0;
+    from->pending = 0;
+}
+
+/*
+ * 用 writev 发送输出队列, 发送完的段放回空闲链表.
+ * 处理部分写; 遇到 EAGAIN 时 wait 为 0 则返回, 剩下的数据留在队列中, 否则等待 fd 可写.
+ */
+static int cli_output_queue_writev(int fd, cli_output_queue_t *q, int wait)
+{
+    struct iovec iov[16];
+
+    if (q->write)
+        return q->write(q, wait);
+
+    while (q->head && !q->error) {
+        cli_output_segment_t *s;
+        int n_iov = 0;
+        ssize_t n;
+
+        for (s = q->head; s && n_iov < 16; s = s->next) {
+            if (s->len == s->start)
+                continue;
+            iov[n_iov].iov_base = s->data + s->start;
+            iov[n_iov].iov_len = s->len - s->start;
+            n_iov++;
+        }
+
+        if (n_iov)
+            cli_thread_self()->output_writes++;
+        n = n_iov ? writev(fd, iov, n_iov) : 0;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+                if (!wait)
+                    return 0;
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            q->error = 1;
+            break;
+        }
+
+        cli_output_queue_consume(q, n);
+    }
+
+    if (q->error) {
+        cli_output_queue_discard(q);
+        return -1;
+    }
+    return 0;
+}
+
+int cli_output_queue_send(int fd, cli_output_queue_t *q)
+{
+    return cli_output_queue_writev(fd, q, /* wait */ 1);
+}
+
+int cli_output_queue_write(int fd, cli_output_queue_t *q)
+{
+    return cli_output_queue_writev(fd, q, /* wait */ 0);
+}
+
+/* 在队列尾部预留 n 个连续字节(n 不超过一个段), 计入待发送但不计入 output_total */
+static char *cli_output_reserve(cli_output_queue_t *q, int n)
+{
+    cli_output_segment_t *s = q->tail;
+    char *p;
+
+    if (!s || CLI_OUTPUT_SEGMENT_SIZE - s->len < n) {
+        if (!(s = cli_output_segment_append(q)))
+            return 0;
+    }
+
+    p = s->data + s->len;
+    s->len += n;
+    q->pending += n;
+    return p;
+}
+
+/* 打开一个 OUTPUT 帧: 先预留帧头, 长度在关闭时填写 */
+static int cli_output_frame_open(cli_ctx_t *ctx)
+{
+    if (!(ctx->output_frame = cli_output_reserve(ctx->output, CLI_FRAME_HEADER_SIZE)))
+        return -1;
+    ctx->output_frame_start = ctx->output_total;
+    return 0;
+}
+
+static void cli_output_frame_close(cli_ctx_t *ctx)
+{
+    if (!ctx->output_frame)
+        return;
+    cli_frame_header_encode(ctx->output_frame, ctx->output_total - ctx->output_frame_start,
+                            ctx->request_id, CLI_FRAME_OUTPUT, 0);
+    ctx->output_frame = 0;
+}
+
+/*
+ * 队列有上限时非阻塞发送, 发送后仍超过上限则按 overflow 处理:
+ * PAUSE 时等待 fd 可写直到降到上限以下, 这样正在执行的命令占用的内存有界, 客户端也不会丢数据;
+ * CLOSE 时之后的输出都丢弃, 连接随后被关闭. 队列中的段可能正在被异步发送, 留到释放连接时再回收.
+ */
+int cli_output_flush(cli_ctx_t *ctx)
+{
+    cli_output_queue_t *q = ctx->output;
+
+    cli_output_frame_close(ctx);
+    ctx->output_flushed = 1;
+    ctx->output_flush_mark = ctx->output_total;
+
+    if (!q->limit)
+        return cli_output_queue_send(ctx->fd, q);
+
+    if (cli_output_queue_write(ctx->fd, q))
+        return -1;
+
+    /* 生成器命令超出上限的最多是一段, 所有者会等队列降下来再继续调用它 */
+    if (ctx->generator && q->wake)
+        return 0;
+
+    while (q->pending > q->limit) {
+        struct pollfd pfd = { .fd = ctx->fd, .events = POLLOUT };
+
+        if (q->overflow == CLI_OUTPUT_OVERFLOW_CLOSE) {
+            q->error = 1;
+            return -1;
+        }
+        if (q->write) {
+            if (q->write(q, /* wait */ 1))
+                return -1;
+            continue;
+        }
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+            return -1;
+        if (cli_output_queue_write(ctx->fd, q))
+            return -1;
+    }
+
+    return 0;
+}
+
+int cli_output_chunk_full(cli_ctx_t *ctx)
+{
+    ctx->generator = 1;
+    return ctx->output_total - ctx->output_chunk_start >= CLI_OUTPUT_HIGH_WATER;
+}
+
+/*
+ * 上次发送之后新追加的输出超过阈值时发送.
+ * 不能按队列中待发送的总量判断: 客户端读得慢时队列一直在阈值以上, 会变成每行都发送一次.
+ */
+static void cli_output_maybe_flush(cli_ctx_t *ctx)
+{
+    int threshold = ctx->output_flushed ? CLI_OUTPUT_HIGH_WATER : CLI_OUTPUT_FIRST_FLUSH;
+
+    if (ctx->output_total - ctx->output_flush_mark >= (uint64_t) threshold)
+        cli_output_flush(ctx);
+}
+
+/* 把 len 字节追加到输出队列 */
+static void cli_output_bytes(cli_ctx_t *ctx, const char *data, int len)
+{
+    cli_output_queue_t *q = ctx->output;
+
+    while (len > 0 && !q->error) {
+        cli_output_segment_t *s;
+        int n;
+
+        if (ctx->framed && !ctx->output_frame && cli_output_frame_open(ctx))
+            return;
+
+        s = q->tail;
+        if (!s || s->len == CLI_OUTPUT_SEGMENT_SIZE) {
+            if (!(s = cli_output_segment_append(q)))
+                return;
+        }
+
+        n = CLI_OUTPUT_SEGMENT_SIZE - s->len;
+        if (n > len)
+            n = len;
+        memcpy(s->data + s->len, data, n);
+        s->len += n;
+        data += n;
+        len -= n;
+        q->pending += n;
+        ctx->output_total += n;
+        cli_output_maybe_flush(ctx);
+    }
+}
+
+/* 追加 n 个字符 c, 用于宽度填充 */
+static void cli_output_fill(cli_ctx_t *ctx, char c, int n)
+{
+    char pad[64];
+
+    memset(pad, c, n < (int) sizeof(pad) ? n : (int) sizeof(pad));
+    while (n > 0) {
+        int k = n < (int) sizeof(pad) ? n : (int) sizeof(pad);
+        cli_output_bytes(ctx, pad, k);
+        n -= k;
+    }
+}
+
+/*
+ * format 引擎.
+ * 类似 VPP 的 format: 一次扫描格式串, 结果直接写入输出段, 不用先算长度;
+ * 整数自己转换, 不经过 libc printf; 浮点数交给 snprintf.
+ * %U 从参数中取一个 cli_format_function_t, 由它消耗自己的参数并输出.
+ */
+
+/* 一个转换说明的 flags, width, precision */
+typedef struct
+{
+    int left;
+    int plus;
+    int space;
+    int alt;
+    int zero;
+    int width;
+    /* 小于 0 表示没有指定 */
+    int precision;
+} cli_format_spec_t;
+
+/* 长度修饰符 */
+enum {
+    CLI_FORMAT_LEN_NONE,
+    CLI_FORMAT_LEN_HH,
+    CLI_FORMAT_LEN_H,
+    CLI_FORMAT_LEN_L,
+    CLI_FORMAT_LEN_LL,
+    CLI_FORMAT_LEN_J,
+    CLI_FORMAT_LEN_Z,
+    CLI_FORMAT_LEN_T,
+    CLI_FORMAT_LEN_LONG_DOUBLE,
+};
+
+static const char cli_format_digit_pairs[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+/* 把 v 按 base 转换到 end 之前, 返回第一个字符的位置 */
+static char *cli_format_u64(char *end, uint64_t v, int base, int upper)
+{
+    const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    char *p = end;
+
+    switch (base) {
+        case 10:
+            /* 每次转换两位 */
+            while (v >= 100) {
+                int r = v % 100;
+                v /= 100;
+                p -= 2;
+                memcpy(p, cli_format_digit_pairs + 2 * r, 2);
+            }
+            if (v >= 10) {
+                p -= 2;
+                memcpy(p, cli_format_digit_pairs + 2 * v, 2);
+            } else {
+                *--p = '0' + v;
+            }
+            break;
+        case 16:
+            do {
+                *--p = digits[v & 15];
+                v >>= 4;
+            } while (v);
+            break;
+        default:
+            do {
+                *--p = '0' + (v & 7);
+                v >>= 3;
+            } while (v);
+            break;
+    }
+
+    return p;
+}
+
+/* 输出带宽度填充的一段内容: [prefix][0...][body] */
+static void cli_format_padded(cli_ctx_t *ctx, cli_format_spec_t *spec,
+                              const char *prefix, int n_prefix, int n_zero,
+                              const char *body, int n_body)
+{
+    int n = n_prefix + n_zero + n_body;
+    int pad = spec->width > n ? spec->width - n : 0;
+
+    if (pad && !spec->left) {
+        /* 没有 precision 时 '0' flag 用 0 填充到 prefix 之后 */
+        if (spec->zero && spec->precision < 0) {
+            n_zero += pad;
+        } else {
+            cli_output_fill(ctx, ' ', pad);
+        }
+        pad = 0;
+    }
+
+    if (n_prefix)
+        cli_output_bytes(ctx, prefix, n_prefix);
+    if (n_zero)
+        cli_output_fill(ctx, '0', n_zero);
+    if (n_body)
+        cli_output_bytes(ctx, body, n_body);
+    if (pad)
+        cli_output_fill(ctx, ' ', pad);
+}
+
+static void cli_format_integer(cli_ctx_t *ctx, cli_format_spec_t *spec,
+                               uint64_t v, int is_signed, int negative, int base, int upper)
+{
+    char buf[24];
+    char *end = buf + sizeof(buf), *p = end;
+    char prefix[2];
+    int n_prefix = 0, n_digits, n_zero;
+
+    /* precision 为 0 时 0 不输出任何数字 */
+    if (v || spec->precision != 0)
+        p = cli_format_u64(end, v, base, upper);
+    n_digits = end - p;
+    n_zero = spec->precision > n_digits ? spec->precision - n_digits : 0;
+
+    if (negative)
+        prefix[n_prefix++] = '-';
+    else if (is_signed && spec->plus)
+        prefix[n_prefix++] = '+';
+    else if (is_signed && spec->space)
+        prefix[n_prefix++] = ' ';
+
+    if (spec->alt) {
+        if (base == 16 && v) {
+            prefix[n_prefix++] = '0';
+            prefix[n_prefix++] = upper ? 'X' : 'x';
+        } else if (base == 8 && n_zero == 0 && (n_digits == 0 || *p != '0')) {
+            n_zero = 1;
+        }
+    }
+
+    cli_format_padded(ctx, spec, prefix, n_prefix, n_zero, p, n_digits);
+}
+
+/* 浮点数交给 snprintf, 按已经解析出的 spec 重新拼出转换说明 */
+static void cli_format_double(cli_ctx_t *ctx, cli_format_spec_t *spec,
+                              int length, char conversion, va_list *va)
+{
+    char f[32], buf[128], *out = buf;
+    long double ld = 0;
+    double d = 0;
+    int i = 0, n;
+
+    f[i++] = '%';
+    if (spec->left)
+        f[i++] = '-';
+    if (spec->plus)
+        f[i++] = '+';
+    if (spec->space)
+        f[i++] = ' ';
+    if (spec->alt)
+        f[i++] = '#';
+    if (spec->zero)
+        f[i++] = '0';
+    f[i++] = '*';
+    f[i++] = '.';
+    f[i++] = '*';
+    if (length == CLI_FORMAT_LEN_LONG_DOUBLE)
+        f[i++] = 'L';
+    f[i++] = conversion;
+    f[i] = 0;
+
+    if (length == CLI_FORMAT_LEN_LONG_DOUBLE)
+        ld = va_arg(*va, long double);
+    else
+        d = va_arg(*va, double);
+
+#define _(b, size)                                                      \
+    (length == CLI_FORMAT_LEN_LONG_DOUBLE ?                             \
+     snprintf(b, size, f, spec->width, spec->precision, ld) :           \
+     snprintf(b, size, f, spec->width, spec->precision, d))
+
+    n = _(buf, sizeof(buf));
+    if (n >= (int) sizeof(buf)) {
+        out = (char *) cli_arena_alloc(ctx->arena, n + 1);
+        _(out, n + 1);
+    }
+#undef _
+
+    if (n > 0)
+        cli_output_bytes(ctx, out, n);
+}
+
+/* 解析格式串并输出, 参数从 va 中按顺序消耗 */
+void cli_va_format(cli_ctx_t *ctx, const char *fmt, va_list *va)
+{
+    const char *f = fmt;
+
+    while (*f) {
+        cli_format_spec_t spec;
+        int length, negative, is_signed, base, upper;
+        uint64_t v;
+        const char *s;
+        char c;
+
+        if (*f != '%') {
+            /* 一次输出一整段普通字符 */
+            s = strchr(f, '%');
+            if (!s)
+                s = f + strlen(f);
+            cli_output_bytes(ctx, f, s - f);
+            f = s;
+            continue;
+        }
+
+        f++;
+        memset(&spec, 0, sizeof(spec));
+        spec.precision = -1;
+
+        /* flags */
+        for (;; f++) {
+            switch (*f) {
+                case '-': spec.left = 1; continue;
+                case '+': spec.plus = 1; continue;
+                case ' ': spec.space = 1; continue;
+                case '#': spec.alt = 1; continue;
+                case '0': spec.zero = 1; continue;
+            }
+            break;
+        }
+
+        /* width */
+        if (*f == '*') {
+            spec.width = va_arg(*va, int);
+            if (spec.width < 0) {
+                spec.left = 1;
+                spec.width = -spec.width;
+            }
+            f++;
+        } else {
+            while (*f >= '0' && *f <= '9')
+                spec.width = spec.width * 10 + (*f++ - '0');
+        }
+
+        /* precision */
+        if (*f == '.') {
+            f++;
+            spec.precision = 0;
+            if (*f == '*') {
+                spec.precision = va_arg(*va, int);
+                f++;
+            } else {
+                while (*f >= '0' && *f <= '9')
+                    spec.precision = spec.precision * 10 + (*f++ - '0');
+            }
+        }
+
+        /* length */
+        length = CLI_FORMAT_LEN_NONE;
+        switch (*f) {
+            case 'h':
+                length = CLI_FORMAT_LEN_H;
+                if (*++f == 'h') {
+                    length = CLI_FORMAT_LEN_HH;
+                    f++;
+                }
+                break;
+            case 'l':
+                length = CLI_FORMAT_LEN_L;
+                if (*++f == 'l') {
+                    length = CLI_FORMAT_LEN_LL;
+                    f++;
+                }
+                break;
+            case 'q': length = CLI_FORMAT_LEN_LL; f++; break;
+            case 'j': length = CLI_FORMAT_LEN_J; f++; break;
+            case 'z': length = CLI_FORMAT_LEN_Z; f++; break;
+            case 't': length = CLI_FORMAT_LEN_T; f++; break;
+            case 'L': length = CLI_FORMAT_LEN_LONG_DOUBLE; f++; break;
+        }
+
+        c = *f;
+        if (c == 0)
+            break;
+        f++;
+
+        negative = is_signed = upper = 0;
+        base = 10;
+        switch (c) {
+            case '%':
+                cli_output_bytes(ctx, "%", 1);
+                continue;
+
+            case 'U': {
+                cli_format_function_t *fn = va_arg(*va, cli_format_function_t *);
+                fn(ctx, va);
+                continue;
+            }
+
+            case 'c': {
+                char ch = (char) va_arg(*va, int);
+                cli_format_padded(ctx, &spec, 0, 0, 0, &ch, 1);
+                continue;
+            }
+
+            case 's': {
+                int n;
+                s = va_arg(*va, const char *);
+                if (!s)
+                    s = "(null)";
+                n = spec.precision >= 0 ? (int) strnlen(s, spec.precision) : (int) strlen(s);
+                /* 字符串不用 0 填充 */
+                spec.zero = 0;
+                cli_format_padded(ctx, &spec, 0, 0, 0, s, n);
+                continue;
+            }
+
+            case 'p': {
+                void *ptr = va_arg(*va, void *);
+                if (!ptr) {
+                    spec.zero = 0;
+                    cli_format_padded(ctx, &spec, 0, 0, 0, "(nil)", 5);
+                    continue;
+                }
+                spec.alt = 1;
+                cli_format_integer(ctx, &spec, (uintptr_t) ptr, 0, 0, 16, 0);
+                continue;
+            }
+
+            case 'f': case 'F': case 'e': case 'E':
+            case 'g': case 'G': case 'a': case 'A':
+                cli_format_double(ctx, &spec, length, c, va);
+                continue;
+
+            case 'd':
+            case 'i': {
+                int64_t sv;
+                switch (length) {
+                    case CLI_FORMAT_LEN_HH: sv = (signed char) va_arg(*va, int); break;
+                    case CLI_FORMAT_LEN_H:  sv = (short) va_arg(*va, int); break;
+                    case CLI_FORMAT_LEN_L:  sv = va_arg(*va, long); break;
+                    case CLI_FORMAT_LEN_LL: sv = va_arg(*va, long long); break;
+                    case CLI_FORMAT_LEN_J:  sv = va_arg(*va, intmax_t); break;
+                    case CLI_FORMAT_LEN_Z:  sv = va_arg(*va, ssize_t); break;
+                    case CLI_FORMAT_LEN_T:  sv = va_arg(*va, ptrdiff_t); break;
+                    default:                sv = va_arg(*va, int); break;
+                }
+                is_signed = 1;
+                negative = sv < 0;
+                v = negative ? -(uint64_t) sv : (uint64_t) sv;
+                cli_format_integer(ctx, &spec, v, is_signed, negative, 10, 0);
+                continue;
+            }
+
+            case 'X':
+                upper = 1;
+            case 'x':
+                base = 16;
+                break;
+            case 'o':
+                base = 8;
+                break;
+            case 'u':
+                break;
+
+            default:
+                /* 不认识的转换原样输出 */
+                cli_output_bytes(ctx, "%", 1);
+                cli_output_bytes(ctx, &c, 1);
+                continue;
+        }
+
+        switch (length) {
+            case CLI_FORMAT_LEN_HH: v = (unsigned char) va_arg(*va, unsigned int); break;
+            case CLI_FORMAT_LEN_H:  v = (unsigned short) va_arg(*va, unsigned int); break;
+            case CLI_FORMAT_LEN_L:  v = va_arg(*va, unsigned long); break;
+            case CLI_FORMAT_LEN_LL: v = va_arg(*va, unsigned long long); break;
+            case CLI_FORMAT_LEN_J:  v = va_arg(*va, uintmax_t); break;
+            case CLI_FORMAT_LEN_Z:  v = va_arg(*va, size_t); break;
+            case CLI_FORMAT_LEN_T:  v = va_arg(*va, ptrdiff_t); break;
+            default:                v = va_arg(*va, unsigned int); break;
+        }
+        cli_format_integer(ctx, &spec, v, 0, 0, base, upper);
+    }
+}
+
+void cli_format(cli_ctx_t* ctx, const char *fmt, ...)
+{
+    va_list va;
+
+    va_start(va, fmt);
+    cli_va_format(ctx, fmt, &va);
+    va_end(va);
+}
+
+/* 格式化输出到输出段链表 */
+void cli_output(cli_ctx_t* ctx, int new_line, char* fmt, ...)
+{
+    va_list va;
+
+    if (ctx->output->error)
+        return;
+
+    if (ctx->output_total == 0) {
+        /* 如果没有输出过任何内容, 则不必设置为新行 */
+        new_line = 0;
+    }
+
+    if (new_line)
+        cli_output_bytes(ctx, "\n", 1);
+
+    va_start(va, fmt);
+    cli_va_format(ctx, fmt, &va);
+    va_end(va);
+}
+
+/*
+ * 将 input 标准化后写入 output, output 至少要有 strlen(input) + 1 字节, 可以与 input 相同.
+ * 返回标准化后的长度.
+ */
+static int cli_normalize_into(char *output, char *input) {
+    char *src = input;   // 源指针遍历输入
+    char *dst = output;  // 目标指针写入输出
+    int in_space = 0;    // 标记是否在空格序列中
+    int has_content = 0; // 标记是否有非空格内容
+
+    // 跳过开头的空白字符
+    while (*src != '\0' && isspace((unsigned char)*src)) {
+        src++;
+    }
+
+    // 处理字符串主体
+    while (*src != '\0') {
         // 检查回车符 - 替换为字符串终止符并结束处理
         if (*src == '\r') {
             *dst = '\0';  // 添加字符串终止符
-            *result = output;
-            return;      // 立即返回，不再处理后续字符
+            return dst - output;      // 立即返回，不再处理后续字符
         }
         
         // 检查是否为空白字符（空格/制表符/换行）
@@ -750,6 +2202,24 @@ void cli_normalize_str(char *input, char **result) {
     // 终止字符串
     *dst = '\0';
     
+    return dst - output;
+}
+
+void cli_normalize_str(char *input, char **result) {
+    // 处理输入为NULL或空字符串的情况
+    if (input == NULL || *input == '\0') {
+        *result = strdup("");
+        return;
+    }
+
+    // 分配足够的内存
+    char *output = (char *)malloc(strlen(input) + 1);
+    if (output == NULL) {
+        *result = NULL;
+        return;
+    }
+
+    cli_normalize_into(output, input);
     *result = output;
 }
 
@@ -790,20 +2260,16 @@ static void add_sub_command(int parent_index, int child_index)
     c = &cm.commands[child_index];
 
     l = parent_path_len (c->path);
-    if (l == ~0)
-        sub_name = strdup(c->path);
-    else {
-        sub_name = strdup(c->path + l + 1);
-    }
+    sub_name = l == ~0 ? c->path : c->path + l + 1;
 
     if (!p->sub_command_index_by_name)
         p->sub_command_index_by_name = hash_table_create();
 
     /* Check if sub-command has already been created. */
-    if (hash_table_get(p->sub_command_index_by_name, sub_name, &si)) {
-        free (sub_name);
+    if (hash_table_get(p->sub_command_index_by_name, sub_name, &si))
         return;
-    }
+
+    sub_name = strdup(sub_name);
 
     if (!p->sub_commands) {
         p->sub_commands = (cli_sub_command_t*)calloc(INITIAL_COMMAND_NUM, sizeof(cli_sub_command_t));
@@ -814,9 +2280,17 @@ static void add_sub_command(int parent_index, int child_index)
         p->sub_commands_capacity = p->sub_commands_capacity << 1;
     }
 
+    /* parent 的子命令集合发生变化, 丢弃已编译的前缀树, 直到下一次 cli_freeze 前走 bitmap 匹配 */
+    if (p->sub_command_trie) {
+        free(p->sub_command_trie);
+        p->sub_command_trie = 0;
+        p->sub_command_trie_count = 0;
+    }
+
     /* si 为 child 命令在 parent 命令的 sub command 的索引 */
     si = p->sub_commands_count;
     p->sub_commands_count ++;
+
     sub_c = &p->sub_commands[si];
     // p->sub_commands[si] = (cli_sub_command_t *)malloc(sizeof(cli_sub_command_t));
     sub_c->index = child_index;
@@ -877,8 +2351,7 @@ static void add_sub_command(int parent_index, int child_index)
             }
             pos->bitmaps_max_valid_index = pos->bitmaps_max_valid_index - n;
             for (j = 0; j < -n; j++) {
-                pos->bitmaps[j].bitmap = 0;
-                pos->bitmaps[j].max_valid_index = -1;
+                cli_bitmap_init (&pos->bitmaps[j]);
             }
 	        n = 0;
 	    }
@@ -887,16 +2360,13 @@ static void add_sub_command(int parent_index, int child_index)
             if (pos->bitmaps_max_valid_index == -1) {
                 pos->bitmaps = (bitmap_t*) realloc (pos->bitmaps, 1 * sizeof(bitmap_t));
                 pos->bitmaps_max_valid_index = 0;
-                pos->bitmaps[0].bitmap = 0;
-                pos->bitmaps[0].max_valid_index = -1;
+                cli_bitmap_init (&pos->bitmaps[0]);
             } else {
                 /* 创建下标 [pos->bitmaps_max_valid_index + 1, n] 的 bitmap */
-                pos->bitmaps = (bitmap_t*) realloc (pos->bitmaps, (n + pos->bitmaps_max_valid_index + 1) * sizeof(bitmap_t));
-                for (j = pos->bitmaps_max_valid_index + 1; j <= n; j++) {
-                    pos->bitmaps[j].bitmap = 0;
-                    pos->bitmaps[j].max_valid_index = -1;
-                }
-                pos->bitmaps_max_valid_index += n;
+                pos->bitmaps = (bitmap_t*) realloc (pos->bitmaps, (n + 1) * sizeof(bitmap_t));
+                for (j = pos->bitmaps_max_valid_index + 1; j <= n; j++)
+                    cli_bitmap_init (&pos->bitmaps[j]);
+                pos->bitmaps_max_valid_index = n;
             }
         }
         
@@ -924,19 +2394,20 @@ static void cli_make_parent(int ci)
         return;
     }
 
-    p_path = strndup(c->path, p_len);
-    int found = hash_table_get(cm.command_index_by_path, p_path, &pi);
-    if(found) {
-         /* Parent exists */
-        free(p_path);
-    } else {
+    /* 直接用 c->path 的前缀查找, 只有需要创建 parent 时才复制路径 */
+    int found = hash_table_get_n(cm.command_index_by_path, c->path, p_len, &pi);
+    if(!found) {
         /* Parent does not exist; create it. */
         if (cm.commands_count == cm.commands_capacity) {
             /* 如果此时已经达到最大容量, 则进行扩容 */
             cm.commands = (cli_command_t*)realloc(cm.commands, (cm.commands_capacity << 1) * sizeof(cli_command_t));
+            memset(&cm.commands[cm.commands_capacity], 0, cm.commands_capacity * sizeof(cli_command_t));
             cm.commands_capacity = cm.commands_capacity << 1;
+            /* 扩容后 c 可能已经失效 */
+            c = &cm.commands[ci];
         }
 
+        p_path = strndup(c->path, p_len);
         pi = cm.commands_count;
         cm.commands_count++;
         hash_table_set (cm.command_index_by_path, p_path, pi); // 将命令的路径和索引存入哈希表
@@ -955,6 +2426,59 @@ static void cli_make_parent(int ci)
 /*
  * 注册一个命令
  */
+/*
+ * 检查命令的参数表并编译出关键字索引, 解析时每个单词只需一次哈希查找.
+ * 参数表不合法时返回 -1.
+ */
+static int cli_compile_args(cli_command_t *c)
+{
+    int i, ai;
+
+    c->n_args = 0;
+    c->arg_index_by_keyword = 0;
+    if (!c->args)
+        return 0;
+
+    c->arg_index_by_keyword = hash_table_create();
+    for (i = 0; c->args[i].type != CLI_ARG_END; i++) {
+        cli_arg_t *a = &c->args[i];
+
+        if (i >= CLI_ARGS_MAX)
+            return -1;
+        if (a->offset < 0 || a->offset + a->size > c->args_size)
+            return -1;
+
+        switch (a->type) {
+            case CLI_ARG_FLAG:
+                /* flag 只能通过关键字出现 */
+                if (!a->keyword)
+                    return -1;
+            case CLI_ARG_INT:
+            case CLI_ARG_UINT:
+            case CLI_ARG_HEX:
+                if (a->size != 1 && a->size != 2 && a->size != 4 && a->size != 8)
+                    return -1;
+                break;
+            case CLI_ARG_STRING:
+                if (a->size != sizeof (char *))
+                    return -1;
+                break;
+            default:
+                return -1;
+        }
+
+        if (a->keyword) {
+            /* 关键字重复 */
+            if (hash_table_get (c->arg_index_by_keyword, a->keyword, &ai))
+                return -1;
+            hash_table_set (c->arg_index_by_keyword, a->keyword, i);
+        }
+    }
+    c->n_args = i;
+
+    return 0;
+}
+
 int cli_register(cli_command_t* c)
 {
     int error = 0;
@@ -979,8 +2503,13 @@ int cli_register(cli_command_t* c)
             /* Save internal fields. */
             d->path = save.path;
             d->sub_commands = save.sub_commands;
+            d->sub_commands_count = save.sub_commands_count;
+            d->sub_commands_capacity = save.sub_commands_capacity;
             d->sub_command_index_by_name = save.sub_command_index_by_name;
             d->sub_command_positions = save.sub_command_positions;
+            d->sub_command_positions_capacity = save.sub_command_positions_capacity;
+            d->sub_command_trie = save.sub_command_trie;
+            d->sub_command_trie_count = save.sub_command_trie_count;
             //d->sub_rules = save.sub_rules;
         }
         else
@@ -994,6 +2523,7 @@ int cli_register(cli_command_t* c)
         if (cm.commands_count == cm.commands_capacity) {
             /* 如果此时已经达到最大容量, 则进行扩容 */
             cm.commands = (cli_command_t*) realloc(cm.commands, (cm.commands_capacity << 1) * sizeof(cli_command_t));
+            memset(&cm.commands[cm.commands_capacity], 0, cm.commands_capacity * sizeof(cli_command_t));
             cm.commands_capacity = cm.commands_capacity << 1;
         }
 
@@ -1011,8 +2541,13 @@ int cli_register(cli_command_t* c)
         cm.commands[ci].sub_command_index_by_name = 0;
         cm.commands[ci].sub_command_positions = 0;
         cm.commands[ci].sub_command_positions_capacity = 0;
+        cm.commands[ci].sub_command_trie = 0;
+        cm.commands[ci].sub_command_trie_count = 0;
     }
 
+    if (cli_compile_args (&cm.commands[ci]))
+        return -1;
+
     /* 为命令创建 parent 命令 */
     cli_make_parent(ci);
 
@@ -1020,12 +2555,13 @@ int cli_register(cli_command_t* c)
 }
 
 /* Returns bitmap of commands which match key.  
- * 返回匹配 command 中匹配 key 的 bitmap, bitmap 中置 1 的 bit 为符合的 sub command 的索引(在sub_commands中)
+ * 将 command 中匹配 key 的 sub command 写入调用者提供的 match, 置 1 的 bit 为符合的 sub command 的索引(在sub_commands中)
+ * 返回 match 中置位的个数, 在匹配过程中顺带算出, 调用者不必再扫描一次.
+ * match 的存储由调用者准备好, 匹配过程不分配内存.
  */
-static bitmap_t* cli_sub_command_match(cli_command_t * c, cli_ctx_t* ctx)
+static int cli_sub_command_match(cli_command_t * c, cli_ctx_t* ctx, bitmap_t *match)
 {
-    int i, n;
-    bitmap_t *match = 0;
+    int i, n, n_set = 0;
     cli_parse_position_t *p;
 
     unformat_skip_white_space (ctx);
@@ -1046,52 +2582,237 @@ static bitmap_t* cli_sub_command_match(cli_command_t * c, cli_ctx_t* ctx)
             // case '\r':
             // case '\n':
             case -1:
-                if (i < c->sub_command_positions_capacity && cli_bitmap_count_set_bits (match) > 1) {
+                if (i < c->sub_command_positions_capacity && n_set > 1) {
                     p = &c->sub_command_positions[i];
                     for (n = 0; n < p->bitmaps_max_valid_index + 1; n++)
-                        match = cli_bitmap_andnot (match, &p->bitmaps[n]);
+                        n_set = cli_bitmap_andnot_count (match, &p->bitmaps[n]);
                 }
                 goto done;
 
             default:
                 unformat_put_input (ctx);
-            goto done;
-	    }
+            goto done;
+	    }
+
+        /* 如果读取的位置已经超过了c的最大sub command 长度, 则说明匹配失败 */
+        if (i >= c->sub_command_positions_capacity) {
+no_match:
+            return 0;
+        }
+
+        /* 下面开始考虑命令 c 的位置 i */
+        p = &c->sub_command_positions[i];
+
+        n = k - p->min_char;
+        if (n < 0 || n >= (p->bitmaps_max_valid_index + 1))
+	        goto no_match;
+
+        if (i == 0) {
+	        cli_bitmap_copy (match, &p->bitmaps[n]);
+            n_set = cli_bitmap_count_set_bits (match);
+        } else
+	        n_set = cli_bitmap_and_count (match, &p->bitmaps[n]);
+
+        if (n_set == 0)
+	        goto no_match;
+    }
+
+done:
+  return n_set;
+}
+
+static int cli_sub_command_name_cmp(const void *a, const void *b)
+{
+    const cli_sub_command_t *x = *(const cli_sub_command_t **)a;
+    const cli_sub_command_t *y = *(const cli_sub_command_t **)b;
+    return strcmp(x->name, y->name);
+}
+
+/*
+ * 将命令 c 的所有 sub command 编译成一棵前缀树.
+ * 子命令先按名字排序, 于是拥有相同前缀的子命令在排序结果中连续,
+ * 每个 trie 节点对应排序结果中的一段区间 [lo, hi), 按层次遍历依次生成节点,
+ * 这样同一节点的孩子在数组中自然连续且有序.
+ */
+static int cli_compile_sub_command_trie(cli_command_t *c)
+{
+    cli_sub_command_t **names;
+    cli_trie_node_t *trie;
+    int *lo, *hi, *depth;
+    int i, n, count, max_nodes;
+
+    n = c->sub_commands_count;
+    max_nodes = 1;
+    for (i = 0; i < n; i++)
+        max_nodes += strlen(c->sub_commands[i].name);
+
+    names = (cli_sub_command_t **)malloc(n * sizeof(cli_sub_command_t *));
+    trie = (cli_trie_node_t *)calloc(max_nodes, sizeof(cli_trie_node_t));
+    lo = (int *)malloc(max_nodes * sizeof(int));
+    hi = (int *)malloc(max_nodes * sizeof(int));
+    depth = (int *)malloc(max_nodes * sizeof(int));
+    if (!names || !trie || !lo || !hi || !depth) {
+        free(names);
+        free(trie);
+        free(lo);
+        free(hi);
+        free(depth);
+        return -1;
+    }
+
+    for (i = 0; i < n; i++)
+        names[i] = &c->sub_commands[i];
+    qsort(names, n, sizeof(cli_sub_command_t *), cli_sub_command_name_cmp);
+
+    /* 根节点对应空前缀, 覆盖所有子命令 */
+    count = 1;
+    lo[0] = 0;
+    hi[0] = n;
+    depth[0] = 0;
+
+    for (i = 0; i < count; i++) {
+        cli_trie_node_t *node = &trie[i];
+        int d = depth[i];
+        int j = lo[i];
+        int exact = names[j]->name[d] == 0;
+
+        node->n_matches = hi[i] - lo[i];
+        if (node->n_matches == 1 || exact)
+            node->sub_index = names[j] - c->sub_commands;
+        else
+            node->sub_index = ~0;
+
+        /* 与前缀完全相同的子命令排在区间最前面, 它没有后续字符 */
+        if (exact)
+            j++;
+
+        node->first_child = count;
+        while (j < hi[i]) {
+            char k = names[j]->name[d];
+            int start = j;
+
+            while (j < hi[i] && names[j]->name[d] == k)
+                j++;
+
+            trie[count].c = k;
+            lo[count] = start;
+            hi[count] = j;
+            depth[count] = d + 1;
+            count++;
+            node->n_children++;
+        }
+    }
+
+    free(names);
+    free(lo);
+    free(hi);
+    free(depth);
+
+    c->sub_command_trie = (cli_trie_node_t *)realloc(trie, count * sizeof(cli_trie_node_t));
+    c->sub_command_trie_count = count;
+    return 0;
+}
+
+/*
+ * 使用前缀树匹配 sub command, 语义与 cli_sub_command_match 保持一致:
+ * 返回匹配的个数, 唯一匹配时 *index 为匹配到的 sub command 索引.
+ * 整个过程只沿着 trie 向下走, 不做任何内存分配.
+ */
+static int cli_sub_command_trie_match(cli_command_t *c, cli_ctx_t *ctx, int *index)
+{
+    cli_trie_node_t *trie = c->sub_command_trie;
+    cli_trie_node_t *node = &trie[0];
+    int i, j, match_count;
+
+    unformat_skip_white_space (ctx);
+
+    for (i = 0;; i++) {
+        char k;
+        k = unformat_get_input (ctx);
+        switch (k) {
+            case 'a' ... 'z':
+            case 'A' ... 'Z':
+            case '0' ... '9':
+            case '-':
+            case '_':
+                break;
+
+            case ' ':
+            case -1:
+                if (i == 0)
+                    return 0;
+                /* 前缀匹配到多个时, 只有和前缀完全相同的那个子命令算作匹配 */
+                match_count = node->n_matches;
+                if (match_count > 1)
+                    match_count = node->sub_index != ~0 ? 1 : 0;
+                goto done;
+
+            default:
+                unformat_put_input (ctx);
+                if (i == 0)
+                    return 0;
+                match_count = node->n_matches;
+                goto done;
+        }
 
-        /* 如果读取的位置已经超过了c的最大sub command 长度, 则说明匹配失败 */
-        if (i >= c->sub_command_positions_capacity) {
-no_match:
-            cli_bitmap_free (match);
-            return 0;
+        /* 孩子按字符升序排列 */
+        for (j = 0; j < node->n_children; j++) {
+            cli_trie_node_t *child = &trie[node->first_child + j];
+            if (child->c == k)
+                break;
+            if (child->c > k)
+                return 0;
         }
+        if (j == node->n_children)
+            return 0;
+        node = &trie[node->first_child + j];
+    }
 
-        /* 下面开始考虑命令 c 的位置 i */
-        p = &c->sub_command_positions[i];
+done:
+    if (match_count == 1)
+        *index = node->sub_index;
+    return match_count;
+}
 
-        n = k - p->min_char;
-        if (n < 0 || n >= (p->bitmaps_max_valid_index + 1))
-	        goto no_match;
+/*
+ * 把下一个 token 当作完整的子命令名字, 直接查 sub_command_index_by_name.
+ * token 必须以空格或输入结尾结束, 这时精确匹配的结果和前缀匹配完全一致.
+ * 命中时消耗掉 token 及其后的空格, 返回 1; 未命中时不移动输入位置, 返回 0.
+ */
+static int cli_sub_command_exact_match(cli_command_t *c, cli_ctx_t *ctx, int *index)
+{
+    int start, end;
 
-        if (i == 0)
-	        match = cli_bitmap_dup (&p->bitmaps[n]);
-        else
-	        match = cli_bitmap_and (match, &p->bitmaps[n]);
+    if (!c->sub_command_index_by_name)
+        return 0;
 
-        if (cli_bitmap_is_zero (match))
-	        goto no_match;
+    unformat_skip_white_space (ctx);
+
+    start = end = ctx->index;
+    while (end < ctx->len) {
+        char k = ctx->buffer[end];
+        if (!(isalnum((unsigned char)k) || k == '-' || k == '_'))
+            break;
+        end++;
     }
 
-done:
-  return match;
+    if (end == start || (end < ctx->len && ctx->buffer[end] != ' '))
+        return 0;
+
+    if (!hash_table_get_n (c->sub_command_index_by_name, ctx->buffer + start, end - start, index))
+        return 0;
+
+    ctx->index = end < ctx->len ? end + 1 : end;
+    return 1;
 }
 
 /*
  * 获得一个 parent 命令在 index 为 si 的 child 命令
  */
-static cli_command_t *get_sub_command (cli_command_t* parent, uint32_t si)
+static cli_command_t *get_sub_command (cli_ctx_t *ctx, cli_command_t* parent, uint32_t si)
 {
     cli_sub_command_t *s = &parent->sub_commands[si];
-    return &cm.commands[s->index];
+    return &ctx->commands[s->index];
 }
 
 /*
@@ -1099,19 +2820,48 @@ static cli_command_t *get_sub_command (cli_command_t* parent, uint32_t si)
  * 如果是unique匹配, 会将唯一匹配的 sub command 保存到 result,
  */
 static int parse_cli_sub_command(cli_ctx_t* i, cli_command_t *parent,  cli_command_t **result) {
-    bitmap_t *match_bitmap;
+    bitmap_t match_bitmap;
     int is_unique, index, match_count;
 
-    match_bitmap = cli_sub_command_match (parent, i);  // 根据 输入的命令行字符串，返回匹配的子命令位图
-    match_count = cli_bitmap_count_set_bits (match_bitmap);
+    cli_dispatch_stats_t *stats = i->stats;
+
+    stats->lookups++;
+
+    /* 绝大多数输入都是完整的命令字, 先切出一个 token 在 sub_command_index_by_name 中精确查找 */
+    if (cli_sub_command_exact_match (parent, i, &index)) {
+        stats->exact_hits++;
+        *result = get_sub_command (i, parent, index);
+        return 1;
+    }
+
+    /* 已经 freeze 的节点直接走前缀树 */
+    if (parent->sub_command_trie) {
+        match_count = cli_sub_command_trie_match (parent, i, &index);
+        if (match_count == 1)
+            *result = get_sub_command (i, parent, index);
+        goto done;
+    }
+
+    /* 子命令不多时用 match_bitmap 自带的 inline 存储, 否则从本次请求的 arena 中借用 */
+    if (parent->sub_commands_count > 64 * CLI_BITMAP_INLINE_WORDS) {
+        int words = (parent->sub_commands_count + 63) / 64;
+        cli_bitmap_init_scratch (&match_bitmap, cli_arena_alloc (i->arena, words * sizeof(uint64_t)), words);
+    } else
+        cli_bitmap_init (&match_bitmap);
+    match_count = cli_sub_command_match (parent, i, &match_bitmap);  // 根据 输入的命令行字符串，返回匹配的子命令位图
     is_unique = match_count == 1;
     index = ~0;
     if (is_unique) {
-        index = cli_bitmap_first_set (match_bitmap);
-        *result = get_sub_command (parent, index);
+        index = cli_bitmap_first_set (&match_bitmap);
+        *result = get_sub_command (i, parent, index);
     }
-    cli_bitmap_free (match_bitmap);
+    cli_bitmap_release (&match_bitmap);
 
+done:
+    if (match_count == 1)
+        stats->prefix_hits++;
+    else
+        stats->misses++;
     return match_count;
 }
 
@@ -1122,18 +2872,153 @@ static void cli_output_sub_commands(cli_ctx_t* ctx, cli_command_t* parent)
 
     for (i = 0; i < parent->sub_commands_count; i++) {
         index = parent->sub_commands[i].index;
-        cmd = &cm.commands[index];
+        cmd = &ctx->commands[index];
         cli_output(ctx, NEW_LINE, "%s", parent->sub_commands[i].name);
     }
 }
 
+/* 从当前位置取下一个单词, 返回单词长度, 没有输入时返回 0 */
+static int cli_next_token(cli_ctx_t *ctx, int *start)
+{
+    int i;
+
+    unformat_skip_white_space (ctx);
+    *start = i = ctx->index;
+    while (i < ctx->len && !is_white_space (ctx->buffer[i]))
+        i++;
+    ctx->index = i;
+
+    return i - *start;
+}
+
+/* 把整数 v 写入 size 字节的字段, 超出范围时返回 -1 */
+static int cli_arg_store_integer(void *field, int size, int is_signed, uint64_t v)
+{
+    int bits = size * 8;
+
+    if (bits < 64) {
+        if (is_signed) {
+            int64_t sv = (int64_t) v;
+            if (sv < -(1ll << (bits - 1)) || sv > (1ll << (bits - 1)) - 1)
+                return -1;
+        } else if (v >> bits) {
+            return -1;
+        }
+    }
+
+    switch (size) {
+        case 1:
+            *(uint8_t *) field = v;
+            break;
+        case 2:
+            *(uint16_t *) field = v;
+            break;
+        case 4:
+            *(uint32_t *) field = v;
+            break;
+        default:
+            *(uint64_t *) field = v;
+            break;
+    }
+
+    return 0;
+}
+
+/* 把单词 [start, start + len) 按参数类型转换后写入参数结构体, 值不合法时返回 -1 */
+static int cli_arg_store(cli_ctx_t *ctx, cli_arg_t *a, int start, int len)
+{
+    char *field = (char *) ctx->args + a->offset;
+    char *token = ctx->buffer + start;
+    char *end;
+    uint64_t v;
+
+    switch (a->type) {
+        case CLI_ARG_FLAG:
+            return cli_arg_store_integer (field, a->size, 0, 1);
+
+        case CLI_ARG_INT:
+            errno = 0;
+            v = (uint64_t) strtoll (token, &end, 10);
+            break;
+
+        case CLI_ARG_UINT:
+        case CLI_ARG_HEX:
+            if (*token == '-')
+                return -1;
+            errno = 0;
+            v = strtoull (token, &end, a->type == CLI_ARG_HEX ? 16 : 10);
+            break;
+
+        case CLI_ARG_STRING:
+            end = (char *) cli_arena_alloc (ctx->arena, len + 1);
+            memcpy (end, token, len);
+            end[len] = 0;
+            *(char **) field = end;
+            return 0;
+
+        default:
+            return -1;
+    }
+
+    /* 整个单词都必须是数字 */
+    if (end != token + len || len == 0 || errno == ERANGE)
+        return -1;
+
+    return cli_arg_store_integer (field, a->size, a->type == CLI_ARG_INT, v);
+}
+
+/*
+ * 按命令的参数表从左到右一次解析剩余的输入.
+ * 每个单词先在关键字索引中查找, 命中则(除 flag 外)紧接着取值;
+ * 否则填入下一个位置参数. 不回溯, 解析时间与输入长度成线性关系.
+ */
+static int cli_parse_args(cli_ctx_t *ctx, cli_command_t *c)
+{
+    int next_positional = 0;
+    int start, len, ai;
+    cli_arg_t *a;
+
+    ctx->args = cli_arena_alloc (ctx->arena, c->args_size);
+    memset (ctx->args, 0, c->args_size);
+    ctx->args_present = 0;
+
+    while ((len = cli_next_token (ctx, &start)) > 0) {
+        if (hash_table_get_n (c->arg_index_by_keyword, ctx->buffer + start, len, &ai)) {
+            a = &c->args[ai];
+            if (a->type != CLI_ARG_FLAG) {
+                if (!(len = cli_next_token (ctx, &start))) {
+                    cli_output (ctx, NEW_LINE, " missing value for %s", a->keyword);
+                    return -1;
+                }
+            }
+        } else {
+            for (ai = next_positional; ai < c->n_args && c->args[ai].keyword; ai++)
+                ;
+            if (ai == c->n_args) {
+                cli_output (ctx, NEW_LINE, " unknown argument: %.*s", len, ctx->buffer + start);
+                return -1;
+            }
+            next_positional = ai + 1;
+            a = &c->args[ai];
+        }
+
+        if (cli_arg_store (ctx, a, start, len)) {
+            cli_output (ctx, NEW_LINE, " invalid value: %.*s", len, ctx->buffer + start);
+            return -1;
+        }
+        ctx->args_present |= 1ull << ai;
+    }
+
+    return 0;
+}
+
 static int cli_dispatch_sub_commands (cli_ctx_t* ctx, int parent_command_index)  // 最开始进来为 0
 {
     cli_command_t *parent, *c;
     int error = 0, match_count = 0, i = 0;
     cli_ctx_t sub_input;
 
-    parent = &cm.commands[parent_command_index];
+    parent = &ctx->commands[parent_command_index];
     if (unformat (ctx, "help") || unformat (ctx, "?")) {
         int help_at_end_of_line;
         help_at_end_of_line = unformat_peek_input (ctx) == -1;
@@ -1159,18 +3044,25 @@ static int cli_dispatch_sub_commands (cli_ctx_t* ctx, int parent_command_index)
             si = ctx;
             if (has_sub_commands)
                 /* 如果还有子命令, 则递归进行 dispatch */
-                error = cli_dispatch_sub_commands (si, c - cm.commands);
+                error = cli_dispatch_sub_commands (si, c - ctx->commands);
 
            
             if (!error && c->function) {
-                int error;
                 unformat_skip_white_space (si);
+                si->command = c;
 
                 if (unformat (si, "?") || unformat (si, "help")) {
                     if (c->help) {
                         cli_output(ctx, CUR_LINE, c->help);
                     }
+                } else if (c->args) {
+                    error = cli_parse_args (si, c);
+                    if (!error) {
+                        si->output_chunk_start = si->output_total;
+                        error = c->function (si);
+                    }
                 } else {
+                    si->output_chunk_start = si->output_total;
                     error = c->function (si);
                 }
             }
@@ -1190,33 +3082,518 @@ cli_main_t* get_cli_main() {
     return &cm;
 }
 
+static int show_cli_stats_command_fn(cli_ctx_t* ctx)
+{
+    cli_dispatch_stats_t total = cm.main_thread.stats, *s = &total;
+    cli_thread_t *t;
+
+    /* 各线程的计数分别累加, 这里读到的工作线程计数可能稍旧 */
+    pthread_mutex_lock(&cm.lock);
+    for (t = cm.threads; t; t = t->next) {
+        total.lookups += t->stats.lookups;
+        total.exact_hits += t->stats.exact_hits;
+        total.prefix_hits += t->stats.prefix_hits;
+        total.misses += t->stats.misses;
+    }
+    pthread_mutex_unlock(&cm.lock);
+
+    cli_output(ctx, NEW_LINE, "sub command lookups: %llu", (unsigned long long)s->lookups);
+    cli_output(ctx, NEW_LINE, "  exact token hits:  %llu (%.1f%%)", (unsigned long long)s->exact_hits,
+               s->lookups ? 100.0 * s->exact_hits / s->lookups : 0.0);
+    cli_output(ctx, NEW_LINE, "  prefix matches:    %llu", (unsigned long long)s->prefix_hits);
+    cli_output(ctx, NEW_LINE, "  misses:            %llu", (unsigned long long)s->misses);
+    return 0;
+}
+
+CLI_COMMAND (show_cli_stats_command) = {
+    .path = "show cli stats",
+    .help = "Usage: show cli stats",
+    .function = show_cli_stats_command_fn,
+};
+
+/* 准备一个请求的上下文, 输入拷贝到 arena 中并标准化 */
+static void cli_ctx_init(cli_ctx_t *ctx, int client_fd, cli_output_queue_t *q,
+                         const char *input, int len)
+{
+    /* 上一个请求的临时内存全部回收, 本次请求的所有临时内存都从 arena 中分配 */
+    cli_thread_t *t = cli_thread_self();
+
+    ctx->arena = &t->arena;
+    ctx->stats = &t->stats;
+    ctx->commands = cm.commands;
+    cli_arena_reset(ctx->arena);
+
+    ctx->buffer = (char*) cli_arena_alloc(ctx->arena, len + 1);
+    memcpy(ctx->buffer, input, len);
+    ctx->buffer[len] = 0;
+    /* 原地标准化 */
+    ctx->len = cli_normalize_into(ctx->buffer, ctx->buffer);
+    ctx->index = 0;
+    ctx->fd = client_fd;
+    ctx->framed = 0;
+    ctx->request_id = 0;
+    ctx->output = q;
+    ctx->output_frame = 0;
+    ctx->output_frame_start = 0;
+    ctx->output_flushed = 0;
+    ctx->output_flush_mark = 0;
+    ctx->output_total = 0;
+    ctx->output_chunk_start = 0;
+    ctx->args = 0;
+    ctx->args_present = 0;
+    ctx->command = 0;
+    ctx->async = 0;
+    ctx->async_state = 0;
+    ctx->async_data = 0;
+    ctx->cursor = 0;
+    ctx->generator = 0;
+}
+
+/* 请求结束: 帧格式时追加 DONE 帧, status 为命令的返回值; 否则把输出全部发送出去 */
+static void cli_request_finish(cli_ctx_t *ctx, int error)
+{
+    cli_output_queue_t *q = ctx->output;
+    char *done;
+
+    if (!ctx->framed) {
+        /* 没有任何输出时发送一个占位符 */
+        if (ctx->output_total == 0)
+            cli_output_bytes(ctx, "#", 1);
+        cli_output_flush(ctx);
+        return;
+    }
+
+    cli_output_frame_close(ctx);
+    if ((done = cli_output_reserve(q, CLI_FRAME_HEADER_SIZE)))
+        cli_frame_header_encode(done, 0, ctx->request_id, CLI_FRAME_DONE, error);
+
+    /* 后面还有请求时先不发送, 积累到 high water 再一起发送 */
+    if (q->pending >= CLI_OUTPUT_HIGH_WATER)
+        cli_output_queue_write(ctx->fd, q);
+}
+
+cli_async_t *cli_async(cli_ctx_t *ctx)
+{
+    cli_async_t *a = ctx->async;
+
+    if (a)
+        return a;
+    if (!(a = calloc(1, sizeof(*a))))
+        return 0;
+    a->function = ctx->command->function;
+    /* 在这里就确定由谁唤醒, 命令返回之前 cli_resume 就可能在别的线程被调用 */
+    a->wake = ctx->output->wake;
+    a->owner = ctx->output->owner;
+    a->discard.error = 1;
+    pthread_mutex_init(&a->lock, 0);
+    pthread_cond_init(&a->cond, 0);
+    ctx->async = a;
+    return a;
+}
+
+/*
+ * 命令函数返回了 CLI_PENDING: 把调用栈上的 ctx 和线程 arena 中的内存转给 a,
+ * 线程的 arena 留给下一个请求重新分配. 已经输出的内容先封帧, 所有者可以先发送出去.
+ */
+static void cli_async_suspend(cli_ctx_t *ctx)
+{
+    cli_async_t *a = ctx->async;
+
+    cli_output_frame_close(ctx);
+    a->arena = *ctx->arena;
+    ctx->arena->blocks = 0;
+    a->ctx = *ctx;
+    a->ctx.arena = &a->arena;
+    ctx->output->async = a;
+}
+
+static void cli_async_free(cli_async_t *a)
+{
+    cli_arena_block_t *b, *next;
+
+    for (b = a->arena.blocks; b; b = next) {
+        next = b->next;
+        free(b);
+    }
+    cli_output_queue_discard(&a->discard);
+    pthread_mutex_destroy(&a->lock);
+    pthread_cond_destroy(&a->cond);
+    free(a);
+}
+
+void cli_resume(cli_async_t *a)
+{
+    void (*wake) (void *owner, cli_async_t *a);
+    void *owner;
+
+    /* 唤醒之后 a 随时可能被释放, 先取出 wake/owner */
+    pthread_mutex_lock(&a->lock);
+    a->resumed = 1;
+    wake = a->wake;
+    owner = a->owner;
+    if (!wake)
+        pthread_cond_signal(&a->cond);
+    pthread_mutex_unlock(&a->lock);
+
+    if (wake)
+        wake(owner, a);
+}
+
+int cli_async_continue(cli_async_t *a)
+{
+    int error;
+
+    if (!a->more) {
+        pthread_mutex_lock(&a->lock);
+        a->resumed = 0;
+        pthread_mutex_unlock(&a->lock);
+    }
+
+    a->ctx.output_chunk_start = a->ctx.output_total;
+    error = a->function(&a->ctx);
+    if (error == CLI_PENDING || error == CLI_MORE) {
+        a->more = error == CLI_MORE;
+        cli_output_frame_close(&a->ctx);
+        return 1;
+    }
+
+    cli_request_finish(&a->ctx, error);
+    a->ctx.output->async = 0;
+    cli_async_free(a);
+    return 0;
+}
+
+void cli_async_detach(cli_async_t *a)
+{
+    a->ctx.output->async = 0;
+    if (a->more) {
+        cli_async_free(a);
+        return;
+    }
+    a->ctx.output = &a->discard;
+    a->ctx.output_frame = 0;
+    a->ctx.fd = -1;
+}
+
+/*
+ * 处理命令函数的返回值. 命令挂起(或者是还没结束的生成器)并且队列的所有者会继续执行它时返回 1;
+ * 所有者不处理挂起时在这里等到命令结束.
+ */
+static int cli_request_end(cli_ctx_t *ctx, int error)
+{
+    cli_async_t *a = ctx->async;
+
+    if (error == CLI_MORE && !a && !(a = cli_async(ctx)))
+        error = -1;
+    if (error == CLI_PENDING && !a) {
+        /* 没有调用 cli_async 就返回了 CLI_PENDING, 无法继续 */
+        cli_output(ctx, NEW_LINE, " command can not be suspended");
+        error = -1;
+    }
+    if (error != CLI_PENDING && error != CLI_MORE) {
+        cli_request_finish(ctx, error);
+        if (a)
+            cli_async_free(a);
+        return 0;
+    }
+
+    a->more = error == CLI_MORE;
+    cli_async_suspend(ctx);
+    if (a->wake)
+        return 1;
+
+    do {
+        /* 输出已经出错, 生成器不再继续 */
+        if (a->more && ctx->output->error) {
+            cli_async_detach(a);
+            return 0;
+        }
+        pthread_mutex_lock(&a->lock);
+        while (!a->more && !a->resumed)
+            pthread_cond_wait(&a->cond, &a->lock);
+        pthread_mutex_unlock(&a->lock);
+    } while (cli_async_continue(a));
+    return 0;
+}
+
+/*
+ * 执行一个 REQUEST 帧中的命令, 输出以 OUTPUT 帧追加到 q, 最后追加 DONE 帧.
+ * commands 为匹配使用的命令表.
+ */
+static int cli_request_commands(cli_command_t *commands, cli_output_queue_t *q, int client_fd,
+                                uint32_t request_id, const char *line, int len)
+{
+    cli_ctx_t ctx;
+    int error;
+
+    cli_ctx_init(&ctx, client_fd, q, line, len);
+    ctx.commands = commands;
+    ctx.framed = 1;
+    ctx.request_id = request_id;
+
+    error = cli_dispatch_sub_commands (&ctx, /* parent */ 0);
+    cli_request_end(&ctx, error);
+
+    return q->error ? -1 : 0;
+}
+
 int cli_input(int client_fd, char* user_input) {
-    char* normalize_str = 0;
-    cli_normalize_str(user_input, &normalize_str);
-    int len = strlen(normalize_str);
-    
+    cli_output_queue_t q = { 0 };
     cli_ctx_t ctx;    
-    ctx.buffer = normalize_str;
-    ctx.len = len;
-    ctx.index = 0;
-    ctx.fd = client_fd;
-    ctx.output_buffer = (char*) malloc(256);
-    ctx.output_buffer[0] = '#';
-    ctx.output_index = 0;
-    ctx.output_capacity = 256;
-    cli_dispatch_sub_commands (&ctx, /* parent */ 0);
-    write(client_fd, ctx.output_buffer, ctx.output_index > 0 ? ctx.output_index:1);
-
-    free(normalize_str);
-    free(ctx.output_buffer);
+
+    cli_ctx_init(&ctx, client_fd, &q, user_input, strlen(user_input));
+    /* q 没有设置 wake, 命令挂起时在这里等到它结束 */
+    cli_request_end(&ctx, cli_dispatch_sub_commands (&ctx, /* parent */ 0));
+
+    return 0;
+}
+
+int cli_request(cli_output_queue_t *q, int client_fd, uint32_t request_id, const char *line, int len)
+{
+    return cli_request_commands(cm.commands, q, client_fd, request_id, line, len);
+}
+
+int cli_request_snapshot(cli_snapshot_t *snap, cli_output_queue_t *q, int client_fd,
+                         uint32_t request_id, const char *line, int len)
+{
+    return cli_request_commands(snap->commands, q, client_fd, request_id, line, len);
+}
+
+/*
+ * 只做匹配不执行: 沿着输入匹配到的命令逐级检查, 有函数的命令都必须是 CLI_COMMAND_THREAD_SAFE,
+ * 并且没有 CLI_COMMAND_MAIN_THREAD. 匹配失败的请求只输出错误信息, 在哪里执行都可以.
+ * 在主线程调用, 使用主线程的 arena, 但不计入查找统计.
+ */
+int cli_request_thread_safe(cli_snapshot_t *snap, const char *line, int len)
+{
+    cli_output_queue_t q = { 0 };
+    cli_dispatch_stats_t discard;
+    cli_command_t *parent, *c;
+    cli_ctx_t ctx;
+
+    cli_ctx_init(&ctx, -1, &q, line, len);
+    ctx.commands = snap->commands;
+    ctx.stats = &discard;
+
+    parent = &snap->commands[0];
+    while (!unformat (&ctx, "help") && !unformat (&ctx, "?")
+           && parse_cli_sub_command(&ctx, parent, &c) == 1) {
+        if (c->flags & CLI_COMMAND_MAIN_THREAD)
+            return 0;
+        if (c->function && !(c->flags & CLI_COMMAND_THREAD_SAFE))
+            return 0;
+        if (!c->sub_commands_count)
+            break;
+        parent = c;
+    }
+
+    return 1;
+}
+
+/* 线程相关 */
+
+void cli_thread_register(cli_thread_t *t)
+{
+    memset(t, 0, sizeof(*t));
+    t->shard = -1;
+    cli_thread_current = t;
+
+    pthread_mutex_lock(&cm.lock);
+    t->next = cm.threads;
+    cm.threads = t;
+    pthread_mutex_unlock(&cm.lock);
+}
+
+void cli_thread_unregister(cli_thread_t *t)
+{
+    cli_thread_t **p;
+    cli_arena_block_t *b, *next;
+    cli_output_segment_t *s;
+
+    pthread_mutex_lock(&cm.lock);
+    for (p = &cm.threads; *p; p = &(*p)->next) {
+        if (*p == t) {
+            *p = t->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cm.lock);
+
+    for (b = t->arena.blocks; b; b = next) {
+        next = b->next;
+        free(b);
+    }
+    while ((s = t->output_free_segments)) {
+        t->output_free_segments = s->next;
+        free(s);
+    }
+    if (cli_thread_current == t)
+        cli_thread_current = 0;
+}
+
+uint64_t cli_output_writes(void)
+{
+    uint64_t n = cm.main_thread.output_writes;
+    cli_thread_t *t;
+
+    pthread_mutex_lock(&cm.lock);
+    for (t = cm.threads; t; t = t->next)
+        n += t->output_writes;
+    pthread_mutex_unlock(&cm.lock);
+    return n;
+}
+
+/* 快照相关 */
+
+static void cli_snapshot_free(cli_snapshot_t *snap)
+{
+    int i;
+
+    for (i = 0; i < snap->commands_count; i++) {
+        cli_command_t *c = &snap->commands[i];
+
+        free(c->sub_commands);
+        if (c->sub_command_index_by_name)
+            hash_table_destroy(c->sub_command_index_by_name);
+        free(c->sub_command_trie);
+    }
+    free(snap->commands);
+    free(snap);
+}
+
+/*
+ * 复制当前的命令表. 子命令数组, 名字索引和前缀树每个快照独立一份,
+ * 其它 cli_register 之后不再改变的字段(path, help, 名字字符串, 参数表)与 cm.commands 共用.
+ */
+static cli_snapshot_t *cli_snapshot_create(void)
+{
+    cli_snapshot_t *snap;
+    int i, j;
+
+    snap = (cli_snapshot_t *) calloc(1, sizeof(*snap));
+    if (!snap)
+        return 0;
+    snap->refs = 1;
+    snap->commands_count = cm.commands_count;
+    snap->commands = (cli_command_t *) malloc(cm.commands_count * sizeof(cli_command_t));
+    if (!snap->commands) {
+        free(snap);
+        return 0;
+    }
+    memcpy(snap->commands, cm.commands, cm.commands_count * sizeof(cli_command_t));
+
+    for (i = 0; i < snap->commands_count; i++) {
+        cli_command_t *c = &snap->commands[i];
+        cli_sub_command_t *sub = c->sub_commands;
+
+        c->sub_commands = 0;
+        c->sub_commands_capacity = 0;
+        c->sub_command_index_by_name = 0;
+        c->sub_command_positions = 0;
+        c->sub_command_positions_capacity = 0;
+        c->sub_command_trie = 0;
+        c->sub_command_trie_count = 0;
+        c->next_cli_command = 0;
+        if (!c->sub_commands_count)
+            continue;
+
+        c->sub_commands = (cli_sub_command_t *) malloc(c->sub_commands_count * sizeof(cli_sub_command_t));
+        c->sub_command_index_by_name = hash_table_create();
+        if (!c->sub_commands || !c->sub_command_index_by_name)
+            goto fail;
+        memcpy(c->sub_commands, sub, c->sub_commands_count * sizeof(cli_sub_command_t));
+        c->sub_commands_capacity = c->sub_commands_count;
+        for (j = 0; j < c->sub_commands_count; j++)
+            hash_table_set(c->sub_command_index_by_name, c->sub_commands[j].name, j);
+        if (cli_compile_sub_command_trie (c))
+            goto fail;
+    }
+
+    return snap;
+
+fail:
+    /* i 之后的命令还指向 cm.commands 中的数组, 清零后再统一释放 */
+    for (j = i + 1; j < snap->commands_count; j++) {
+        snap->commands[j].sub_commands = 0;
+        snap->commands[j].sub_command_index_by_name = 0;
+        snap->commands[j].sub_command_trie = 0;
+    }
+    cli_snapshot_free(snap);
+    return 0;
+}
+
+void cli_snapshot_release(cli_snapshot_t *snap)
+{
+    if (__atomic_sub_fetch(&snap->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        cli_snapshot_free(snap);
+}
+
+cli_snapshot_t *cli_snapshot_refresh(cli_snapshot_t *snap)
+{
+    cli_snapshot_t *current = __atomic_load_n(&cm.snapshot, __ATOMIC_ACQUIRE);
+
+    /* 调用者持有 snap 的引用, snap 不会被释放, 指针相同就一定是同一个快照 */
+    if (snap == current)
+        return snap;
+
+    pthread_mutex_lock(&cm.lock);
+    current = cm.snapshot;
+    if (current)
+        __atomic_add_fetch(&current->refs, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&cm.lock);
+
+    if (snap)
+        cli_snapshot_release(snap);
+    return current;
+}
+
+/* 发布新的快照, 旧快照在最后一个使用者释放后回收 */
+static int cli_snapshot_publish(void)
+{
+    cli_snapshot_t *snap = cli_snapshot_create(), *old;
+
+    if (!snap)
+        return -1;
+
+    pthread_mutex_lock(&cm.lock);
+    old = cm.snapshot;
+    __atomic_store_n(&cm.snapshot, snap, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&cm.lock);
+
+    if (old)
+        cli_snapshot_release(old);
     return 0;
 }
 
+/*
+ * 冻结命令树: 为每个还没有前缀树的命令编译子命令前缀树, 并发布一个只读快照给工作线程使用.
+ * 之后再 cli_register 的命令会让其 parent 的前缀树失效, 重新调用 cli_freeze 即可.
+ * cli_register/cli_freeze 只能在主线程调用.
+ */
+int cli_freeze()
+{
+    int i;
+
+    for (i = 0; i < cm.commands_count; i++) {
+        cli_command_t *c = &cm.commands[i];
+
+        if (c->sub_commands_count == 0 || c->sub_command_trie)
+            continue;
+        if (cli_compile_sub_command_trie (c))
+            return -1;
+    }
+
+    return cli_snapshot_publish();
+}
+
 int cli_init()
 {
     int error = 0;
     cli_command_t *cmd;
 
+    cli_bitmap_kernels_init ();
+    pthread_mutex_init(&cm.lock, 0);
+
     if (!cm.commands) {
         cm.commands = (cli_command_t*)calloc(INITIAL_COMMAND_NUM, sizeof(cli_command_t));
         cm.commands_count = 0;
@@ -1241,5 +3618,5 @@ int cli_init()
         cmd = cmd->next_cli_command;
     }
 
-    return error;
+    return cli_freeze();
 }
\ No newline at end of file
@@ -1,6 +1,11 @@
 #ifndef CLI_H_
 #define CLI_H_
 
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
 #define NEW_LINE 1
 #define CUR_LINE 0
 
@@ -11,10 +16,23 @@ typedef struct
   unsigned int index;
 } cli_sub_command_t;
 
+/* 子命令数不超过 64 * CLI_BITMAP_INLINE_WORDS 时, bitmap 数据直接存放在结构体内部 */
+#define CLI_BITMAP_INLINE_WORDS 2
+
 typedef struct
 {
-  uint32_t *bitmap;
+  union
+  {
+    /* capacity > 0 时使用: 堆上分配或调用者提供的存储 */
+    uint64_t *bitmap;
+    /* capacity == 0 时使用 */
+    uint64_t inline_bitmap[CLI_BITMAP_INLINE_WORDS];
+  };
   int max_valid_index;
+  /* bitmap 指向的存储可以容纳的 word 数, 0 表示使用 inline_bitmap */
+  int capacity;
+  /* bitmap 指向调用者提供的存储, 不能 free */
+  int is_scratch;
 } bitmap_t;
 
 typedef struct
@@ -24,6 +42,155 @@ typedef struct
   int bitmaps_max_valid_index;
 } cli_parse_position_t;
 
+/* 子命令前缀树节点, 由 cli_freeze 编译生成.
+ * 同一节点的孩子在数组中连续存放, 并按字符升序排列.
+ */
+typedef struct
+{
+  /* 第一个孩子在 trie 数组中的下标 */
+  int first_child;
+  int n_children;
+  /* 以该节点前缀开头的子命令个数 */
+  int n_matches;
+  /* n_matches == 1 时为唯一匹配的子命令, 否则为与前缀完全相同的子命令(没有则为 ~0) */
+  int sub_index;
+  char c;
+} cli_trie_node_t;
+
+/* arena 中的一块连续内存 */
+typedef struct cli_arena_block_t
+{
+  struct cli_arena_block_t *next;
+  int size;
+  int used;
+  /* 最近一次分配在 data 中的偏移, 用于原地扩展 */
+  int last;
+  char data[] __attribute__ ((aligned (16)));
+} cli_arena_block_t;
+
+/* 请求级别的 bump 内存池.
+ * 同一个请求内的临时内存都从这里分配, 不单独释放;
+ * 请求结束后 reset, 内存留给下一个请求继续使用.
+ */
+typedef struct
+{
+  /* 当前使用的块在链表头部 */
+  cli_arena_block_t *blocks;
+} cli_arena_t;
+
+/* 命令参数的类型 */
+typedef enum
+{
+  /* 参数表结束 */
+  CLI_ARG_END = 0,
+  /* 只有关键字, 出现时字段置 1 */
+  CLI_ARG_FLAG,
+  /* 有符号十进制整数 */
+  CLI_ARG_INT,
+  /* 无符号十进制整数 */
+  CLI_ARG_UINT,
+  /* 十六进制整数, 可以带 0x 前缀 */
+  CLI_ARG_HEX,
+  /* 一个单词, 字段类型为 char *, 指向本次请求 arena 中的拷贝 */
+  CLI_ARG_STRING,
+} cli_arg_type_t;
+
+/* 参数表最多 64 项, 出现过的参数记录在 cli_ctx_t 的 args_present 中 */
+#define CLI_ARGS_MAX 64
+
+/*
+ * 命令参数描述.
+ * keyword 不为 0 时, 输入为 "keyword value"(CLI_ARG_FLAG 只有 keyword), 关键字出现的顺序任意;
+ * keyword 为 0 时为位置参数, 不是关键字的单词按顺序依次填入位置参数.
+ * 解析结果按 offset/size 写入命令的参数结构体.
+ */
+typedef struct
+{
+  char *keyword;
+  cli_arg_type_t type;
+  int offset;
+  int size;
+} cli_arg_t;
+
+/* 描述参数结构体 type 中的字段 field */
+#define CLI_ARG(keyword, arg_type, type, field) \
+  { keyword, arg_type, offsetof (type, field), sizeof (((type *) 0)->field) }
+
+/* 输出段的大小 */
+#define CLI_OUTPUT_SEGMENT_SIZE 4096
+/* 第一次发送的阈值: 输出超过一个段就先发出去, 让客户端尽早看到结果 */
+#define CLI_OUTPUT_FIRST_FLUSH CLI_OUTPUT_SEGMENT_SIZE
+/* 之后待发送的输出达到 high water 时用 writev 发送, 每个请求占用的输出内存不超过这个量级 */
+#define CLI_OUTPUT_HIGH_WATER (4 * CLI_OUTPUT_SEGMENT_SIZE)
+
+/* 输出段, 待发送的数据为 data[start, len) */
+typedef struct cli_output_segment_t
+{
+  struct cli_output_segment_t *next;
+  int start;
+  int len;
+  char data[CLI_OUTPUT_SEGMENT_SIZE];
+} cli_output_segment_t;
+
+/* 输出队列中待发送的数据超过上限时的处理方式 */
+typedef enum
+{
+  /*
+   * 暂停执行该连接后续的请求, 等队列中的数据发送出去再继续;
+   * 正在执行的命令的输出超过上限时, 等待 socket 可写.
+   */
+  CLI_OUTPUT_OVERFLOW_PAUSE = 0,
+  /* 丢弃输出并关闭连接 */
+  CLI_OUTPUT_OVERFLOW_CLOSE,
+} cli_output_overflow_t;
+
+struct cli_async_t;
+
+/*
+ * 待发送的输出队列, 由输出段组成的链表.
+ * 同一个连接上流水线执行的多个请求共用一个队列, 以帧格式输出时帧头也直接写在段中.
+ */
+typedef struct cli_output_queue_t
+{
+  cli_output_segment_t *head;
+  cli_output_segment_t *tail;
+  /* 尚未发送的字节数 */
+  int pending;
+  /* 发送失败, 之后的输出直接丢弃 */
+  int error;
+  /* 待发送数据的上限, 超过时按 overflow 处理; 为 0 时不限制, 输出阻塞发送 */
+  int limit;
+  cli_output_overflow_t overflow;
+  /*
+   * 不为 0 时代替 writev 发送队列, 例如把发送提交给 io_uring, 发送完成后用 cli_output_queue_consume 释放.
+   * wait 为 0 时只需要开始发送; 不为 0 时等到有数据发送出去或者出错才返回.
+   */
+  int (*write) (struct cli_output_queue_t *q, int wait);
+  /*
+   * 队列所有者处理挂起请求的方式(见 cli_async): wake 为 0 时挂起的请求在 cli_request 中阻塞等待;
+   * 否则 cli_resume 调用 wake 通知 owner, 由 owner 在自己的线程上调用 cli_async_continue.
+   */
+  void (*wake) (void *owner, struct cli_async_t *a);
+  void *owner;
+  /* 该队列上正在挂起的请求, 完成之前同一连接上后面的请求不能执行 */
+  struct cli_async_t *async;
+} cli_output_queue_t;
+
+/* 子命令查找的统计 */
+typedef struct
+{
+    /* 查找子命令的总次数 */
+    uint64_t lookups;
+    /* 完整命令字直接在 sub_command_index_by_name 中命中 */
+    uint64_t exact_hits;
+    /* 精确查找未命中, 通过前缀缩写唯一匹配 */
+    uint64_t prefix_hits;
+    /* 没有匹配或者匹配到多个 */
+    uint64_t misses;
+} cli_dispatch_stats_t;
+
+struct cli_command_t;
+
 typedef struct _cli_cxt_t
 {
     /* Input buffer */
@@ -32,17 +199,68 @@ typedef struct _cli_cxt_t
     /* Current index in input buffer. */
     int index;
     int fd;
+    /* 输出以 cli_proto.h 中的帧格式发送, request_id 为所属请求 */
+    int framed;
+    uint32_t request_id;
 
-    char *output_buffer;
-    int output_index;
-    int output_capacity;
-} cli_ctx_t;
+    /* 输出队列 */
+    cli_output_queue_t *output;
+    /* 当前 OUTPUT 帧的帧头在段中的位置, 为 0 表示还没有打开帧 */
+    char *output_frame;
+    /* 打开当前帧时的 output_total */
+    uint64_t output_frame_start;
+    /* 本次请求已经发送过输出, 以及最近一次发送时的 output_total */
+    int output_flushed;
+    uint64_t output_flush_mark;
+    /* 本次请求输出的总字节数(不含帧头), 包括已经发送的 */
+    uint64_t output_total;
+    /* 本次调用命令函数之前的 output_total, 见 cli_output_chunk_full */
+    uint64_t output_chunk_start;
 
-struct cli_command_t;
+    /* 本次请求的临时内存, 命令函数也可以通过 cli_ctx_alloc 使用 */
+    cli_arena_t *arena;
+    /* 子命令查找的统计, 记在执行请求的线程上 */
+    cli_dispatch_stats_t *stats;
+    /* 本次请求匹配的命令表: cm.commands 或者某个已发布快照中的副本 */
+    struct cli_command_t *commands;
+    /* 正在执行的命令 */
+    struct cli_command_t *command;
+
+    /* 命令挂起过时为 cli_async 返回的句柄 */
+    struct cli_async_t *async;
+    /* 由挂起的命令函数使用: 下次被调用时从哪里继续, 第一次调用时为 0; 以及它自己的数据 */
+    int async_state;
+    void *async_data;
+    /* 生成器命令的游标, 第一次调用时为 0, 见 CLI_MORE */
+    uint64_t cursor;
+    /* 命令调用过 cli_output_chunk_full, 是生成器 */
+    int generator;
+
+    /* 命令声明了参数表时, 为解析好的参数结构体, 否则为 0 */
+    void *args;
+    /* 第 i 位置 1 表示参数表中第 i 项在输入中出现过 */
+    uint64_t args_present;
+} cli_ctx_t;
 
 /* CLI command callback function. */
 typedef int (*cli_command_function_t) (cli_ctx_t* user_input);
 
+/* 命令函数返回 CLI_PENDING 表示命令已经挂起, 见 cli_async */
+#define CLI_PENDING (-0x10000)
+
+/*
+ * 生成器命令: 每次调用只输出一段(到 cli_output_chunk_full 为止), 用 ctx->cursor 记住位置,
+ * 还有输出时返回 CLI_MORE. 服务端在发送队列有空间时再次调用, 与其它连接的请求轮流执行,
+ * 客户端不读时不再调用, 连接关闭后直接结束, 输出占用的内存与表的大小无关.
+ * 不在服务端执行时(cli_input, 工作线程)连续调用到结束.
+ */
+#define CLI_MORE (-0x10001)
+
+/* 命令可以在工作线程中执行, 函数只能访问请求本身和线程安全的数据 */
+#define CLI_COMMAND_THREAD_SAFE (1 << 0)
+/* 匹配到该命令(包括没有函数的父命令)的请求总是在主线程执行 */
+#define CLI_COMMAND_MAIN_THREAD (1 << 1)
+
 /* 定义一个命令 */
 typedef struct cli_command_t
 {
@@ -50,6 +268,8 @@ typedef struct cli_command_t
   char *help;
   /* Callback function. */
   cli_command_function_t function;
+  /* CLI_COMMAND_xxx, 默认为 0, 命令只在主线程执行 */
+  int flags;
 
   /* Sub commands for this command. */
   cli_sub_command_t *sub_commands;
@@ -61,9 +281,93 @@ typedef struct cli_command_t
 
   cli_parse_position_t *sub_command_positions;
   int sub_command_positions_capacity;
+
+  /* cli_freeze 编译出的前缀树, 为 0 表示该节点仍然可变, 匹配走 bitmap */
+  cli_trie_node_t *sub_command_trie;
+  int sub_command_trie_count;
+
+  /* 参数表, 以 CLI_ARG_END 结尾; 为 0 时由命令函数自己解析输入 */
+  cli_arg_t *args;
+  /* 参数结构体的大小 */
+  int args_size;
+
+  /* cli_register 时由 args 编译生成: 参数个数及关键字到参数下标的索引 */
+  int n_args;
+  void *arg_index_by_keyword;
+
   struct cli_command_t *next_cli_command;
 } cli_command_t;
 
+/* 每个线程最多缓存的空闲输出段, 多出来的直接 free */
+#define CLI_OUTPUT_FREE_MAX 64
+
+/*
+ * 执行命令的线程私有的状态.
+ * 主线程使用 cm.main_thread, 其它线程执行命令前先用 cli_thread_register 注册自己的.
+ */
+typedef struct cli_thread_t
+{
+    /* 请求的临时内存, 每个请求开始时 reset */
+    cli_arena_t arena;
+
+    cli_dispatch_stats_t stats;
+
+    /* 空闲的输出段, 发送完的段放回这里重复使用 */
+    cli_output_segment_t *output_free_segments;
+    int output_free_count;
+    /* 发送输出调用 writev 的次数 */
+    uint64_t output_writes;
+
+    /* 所在的分片, 主线程为 0, 不属于任何分片的线程为 -1 */
+    int shard;
+
+    struct cli_thread_t *next;
+} cli_thread_t;
+
+/*
+ * cli_freeze 发布的只读命令树: 命令表的完整副本, 每个有子命令的节点都编译好了前缀树.
+ * 之后的 cli_register/cli_freeze 只修改 cm.commands 并发布新的快照,
+ * 已经发布的快照不再修改, 工作线程可以不加锁地读.
+ */
+typedef struct
+{
+    cli_command_t *commands;
+    int commands_count;
+    /* 引用计数, cm.snapshot 本身持有一个 */
+    int refs;
+} cli_snapshot_t;
+
+/*
+ * 挂起的命令.
+ * 命令函数要等待别的线程(例如数据面)的结果时, 调用 cli_async 得到句柄, 把句柄交给干活的一方后
+ * 返回 CLI_PENDING; 结果准备好以后在任意线程调用 cli_resume, 命令函数随后在执行请求的线程上
+ * 以同一个 ctx 再次被调用, 可以根据 ctx->async_state 从上次停下的地方继续, 直到返回 CLI_PENDING
+ * 以外的值, 这时才结束请求. 挂起期间 ctx, 输入和 cli_ctx_alloc 分配的内存一直有效,
+ * 服务端继续处理其它连接, 同一连接上后面的请求等它完成.
+ */
+typedef struct cli_async_t
+{
+    cli_ctx_t ctx;
+    cli_command_function_t function;
+    /* 挂起时从线程的 arena 中接管过来的内存 */
+    cli_arena_t arena;
+    /* 请求的输出队列不再有效(例如连接已经关闭)时输出改到这里, 直接丢弃 */
+    cli_output_queue_t discard;
+
+    /* 命令返回了 CLI_MORE, 由所有者在合适的时候直接继续, 不等 cli_resume */
+    int more;
+    /* cli_resume 已经调用, 还没有继续执行 */
+    int resumed;
+    void (*wake) (void *owner, struct cli_async_t *a);
+    void *owner;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    /* 以下由 owner 使用 */
+    void *user;
+    struct cli_async_t *prev, *next, *wake_next;
+} cli_async_t;
+
 typedef struct cli_main_t
 {
     cli_command_t *commands;
@@ -71,6 +375,14 @@ typedef struct cli_main_t
     int commands_capacity;
     void *command_index_by_path;
     cli_command_t *cli_command_registrations;
+
+    /* 主线程(调用 cli_input/cli_request 的线程)的状态 */
+    cli_thread_t main_thread;
+
+    /* 已注册的其它线程, 以及最近一次发布的快照, 由 lock 保护 */
+    cli_thread_t *threads;
+    cli_snapshot_t *snapshot;
+    pthread_mutex_t lock;
 } cli_main_t;
 
 cli_main_t* get_cli_main();
@@ -88,10 +400,137 @@ cli_main_t* get_cli_main();
 
 int cli_init();
 
+int cli_register(cli_command_t* c);
+
+int cli_freeze();
+
 int cli_input(int client_fd, char* user_input);
 
+/*
+ * 执行一条命令, 回复以帧格式追加到输出队列 q.
+ * 输出超过 high water 时才发送, 调用者处理完一批请求后用 cli_output_queue_write 发送剩下的.
+ */
+int cli_request(cli_output_queue_t *q, int client_fd, uint32_t request_id, const char *line, int len);
+
+/*
+ * 在快照 snap 上执行一条命令, 可以在任意已注册的线程中调用.
+ * 输出只追加到 q, 不直接写 socket; q->write 不为 0 时由它负责发送.
+ */
+int cli_request_snapshot(cli_snapshot_t *snap, cli_output_queue_t *q, int client_fd,
+                         uint32_t request_id, const char *line, int len);
+
+/* 请求匹配到的命令是否都可以在工作线程中执行 */
+int cli_request_thread_safe(cli_snapshot_t *snap, const char *line, int len);
+
+/*
+ * 返回当前发布的快照的引用. s 为调用者持有的旧引用(可以为 0):
+ * s 仍然是最新的快照时直接返回 s, 否则释放 s. 没有发布过快照时返回 0.
+ */
+cli_snapshot_t *cli_snapshot_refresh(cli_snapshot_t *s);
+
+void cli_snapshot_release(cli_snapshot_t *s);
+
+/*
+ * 在命令函数中调用, 准备挂起当前请求, 之后返回 CLI_PENDING. 同一个请求多次调用返回同一个句柄.
+ * 命令返回 CLI_PENDING 之前 ctx 仍然是调用栈上的, 只有 cli_resume 可以提前调用.
+ * 调用之后命令没有返回 CLI_PENDING 时句柄随请求一起释放, 不能再 cli_resume. 内存不足时返回 0.
+ */
+cli_async_t *cli_async(cli_ctx_t *ctx);
+
+/* 挂起的命令可以继续执行了, 可以在任意线程调用; 之后 a 由执行请求的一方负责释放 */
+void cli_resume(cli_async_t *a);
+
+/*
+ * 由队列的 owner 在执行请求的线程上调用: 再次执行挂起的命令函数.
+ * 命令再次挂起时返回 1; 否则结束请求(追加 DONE 帧), 释放 a, 返回 0.
+ */
+int cli_async_continue(cli_async_t *a);
+
+/*
+ * 请求的输出队列即将释放: 之后的输出都丢弃, 命令仍然在 cli_resume 之后继续执行到结束.
+ * 生成器命令(a->more)不再继续, a 直接释放.
+ */
+void cli_async_detach(cli_async_t *a);
+
+/* 注册/注销执行命令的线程, t 由调用者提供, 注销前一直有效 */
+void cli_thread_register(cli_thread_t *t);
+void cli_thread_unregister(cli_thread_t *t);
+
+/* 当前线程的状态, 没有注册时为 cm.main_thread */
+cli_thread_t *cli_thread_self(void);
+
+/* 命令函数所在的分片, 用于读取按核分开的数据; 不在分片线程中执行时为 -1 */
+#define cli_shard_id() (cli_thread_self()->shard)
+
+/* 所有线程 writev 次数之和 */
+uint64_t cli_output_writes(void);
+
 void cli_output(cli_ctx_t* input, int new_line, char* fmt, ...);
 
+/*
+ * 追加格式化输出, 不处理换行. 支持常用的 printf 转换, 另外:
+ * %U 从参数中取一个 cli_format_function_t 及其参数, 由它负责输出, 例如
+ *   cli_format (ctx, "%U", format_counter, value);
+ */
+typedef void (cli_format_function_t) (cli_ctx_t *ctx, va_list *va);
+
+void cli_format(cli_ctx_t* ctx, const char *fmt, ...);
+
+void cli_va_format(cli_ctx_t* ctx, const char *fmt, va_list *va);
+
+/* 把已经缓存的输出立即发送出去 */
+int cli_output_flush(cli_ctx_t* ctx);
+
+/*
+ * 本次调用的输出已经够一段, 生成器命令应当返回 CLI_MORE.
+ * 调用过它的命令输出时不再等待 socket 可写, 发送队列满时由服务端暂停调用.
+ */
+int cli_output_chunk_full(cli_ctx_t *ctx);
+
+/* 阻塞发送输出队列中的所有数据 */
+int cli_output_queue_send(int fd, cli_output_queue_t *q);
+
+/* 非阻塞发送, 发送到 EAGAIN 为止, 剩下的数据留在队列中 */
+int cli_output_queue_write(int fd, cli_output_queue_t *q);
+
+/* 丢弃输出队列中未发送的数据 */
+void cli_output_queue_discard(cli_output_queue_t *q);
+
+/* 队列头部的 n 字节已经发送, 发送完的段放回空闲链表 */
+void cli_output_queue_consume(cli_output_queue_t *q, int n);
+
+/* 把 from 中的所有段移到 to 的末尾, from 变为空 */
+void cli_output_queue_splice(cli_output_queue_t *to, cli_output_queue_t *from);
+
+void *cli_arena_alloc(cli_arena_t *a, int size);
+
+void *cli_arena_realloc(cli_arena_t *a, void *p, int old_size, int new_size);
+
+void cli_arena_reset(cli_arena_t *a);
+
+/* 分配本次请求内有效的临时内存, 请求结束后自动回收 */
+void *cli_ctx_alloc(cli_ctx_t *ctx, int size);
+
+/* 参数表中第 i 项是否在输入中出现过 */
+#define cli_arg_is_set(ctx, i) (((ctx)->args_present >> (i)) & 1)
+
 int unformat (cli_ctx_t* input, const char *fmt, ...);
 
+/* 预编译的 unformat 格式 */
+typedef struct cli_unformat_program_t cli_unformat_program_t;
+
+int unformat_cached (cli_ctx_t* input, cli_unformat_program_t **program, const char *fmt, ...);
+
+/*
+ * fmt 为字符串常量时, 每个调用点第一次调用时把 fmt 编译成 unformat 程序并缓存在调用点的静态变量中,
+ * 之后直接执行编译好的程序, 不再解释格式字符串; 其它情况仍然走逐字符解释.
+ */
+#define unformat(input, fmt, ...)                                             \
+  ({                                                                          \
+    static cli_unformat_program_t *_unformat_program;                         \
+    __builtin_constant_p (fmt)                                                \
+      ? unformat_cached (input, &_unformat_program, fmt, ##__VA_ARGS__)       \
+      : (unformat) (input, fmt, ##__VA_ARGS__);                               \
+  })
+
 #endif
\ No newline at end of file
@@ -0,0 +1,74 @@
+#ifndef CLI_PROTO_H_
+#define CLI_PROTO_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+/*
+ * 控制 socket 上的帧格式.
+ * 每个帧由固定 12 字节的头部和 length 字节的负载组成, 头部字段均为网络字节序:
+ *
+ *   0        4            8      10       12
+ *   | length | request_id | type | status | payload ...
+ *
+ * 客户端发送 REQUEST 帧, 负载为一条命令;
+ * 服务端对每个请求回复若干 OUTPUT 帧(命令的输出, 可以为 0 个), 最后以一个 DONE 帧结束,
+ * DONE 帧的 status 为命令的返回值. 回复帧的 request_id 与请求相同.
+ */
+
+#define CLI_FRAME_HEADER_SIZE 12
+
+/* 单个帧负载的最大长度, 超过时认为对端出错 */
+#define CLI_FRAME_MAX_PAYLOAD (1 << 20)
+
+#define foreach_cli_frame_type          \
+  _(REQUEST, 1)                         \
+  _(OUTPUT, 2)                          \
+  _(DONE, 3)
+
+typedef enum
+{
+#define _(n, v) CLI_FRAME_##n = v,
+  foreach_cli_frame_type
+#undef _
+} cli_frame_type_t;
+
+typedef struct
+{
+  uint32_t length;
+  uint32_t request_id;
+  uint16_t type;
+  int16_t status;
+} cli_frame_header_t;
+
+static inline void
+cli_frame_header_encode (char *buf, uint32_t length, uint32_t request_id,
+                         uint16_t type, int16_t status)
+{
+  uint32_t l = htonl (length), id = htonl (request_id);
+  uint16_t t = htons (type), s = htons ((uint16_t) status);
+
+  memcpy (buf, &l, 4);
+  memcpy (buf + 4, &id, 4);
+  memcpy (buf + 8, &t, 2);
+  memcpy (buf + 10, &s, 2);
+}
+
+static inline void
+cli_frame_header_decode (const char *buf, cli_frame_header_t *h)
+{
+  uint32_t l, id;
+  uint16_t t, s;
+
+  memcpy (&l, buf, 4);
+  memcpy (&id, buf + 4, 4);
+  memcpy (&t, buf + 8, 2);
+  memcpy (&s, buf + 10, 2);
+  h->length = ntohl (l);
+  h->request_id = ntohl (id);
+  h->type = ntohs (t);
+  h->status = (int16_t) ntohs (s);
+}
+
+#endif
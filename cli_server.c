@@ -0,0 +1,1984 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#ifdef CLI_USE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
+#include "cli.h"
+#include "cli_proto.h"
+#include "cli_server.h"
+
+/* 每次 read 至少预留的空间 */
+#define CLI_CONN_READ_SIZE 4096
+
+/*
+ * 当前线程正在处理的服务端的统计, 每个分片只由自己的线程修改.
+ * 不属于任何服务端的连接(单独使用 cli_conn_event)记在 cli_server_stats_default 中.
+ */
+static cli_server_stats_t cli_server_stats_default;
+
+static void cli_server_conn_add (cli_server_t *s, int fd);
+static __thread cli_server_stats_t *cli_server_stats = &cli_server_stats_default;
+
+/* 所有服务端, 由 cli_servers_lock 保护 */
+static cli_server_t *cli_servers;
+static pthread_mutex_t cli_servers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* 交给工作线程执行的请求 */
+typedef struct cli_job_t
+{
+    /* jobs 队列和 events 队列的链表 */
+    struct cli_job_t *next;
+    struct cli_job_t *event_next;
+    int on_events;
+    cli_server_t *server;
+    /* 请求所属的连接, 连接关闭后为 0, 输出直接丢弃 */
+    cli_conn_t *conn;
+    /* 命令的输出, 只由工作线程访问; write 为 cli_job_write */
+    cli_output_queue_t out;
+    /* 已经交出还没被 I/O 线程取走的输出 */
+    cli_output_queue_t handoff;
+    /* handoff 加上连接发送队列中还没发出去的字节数, 由 I/O 线程更新 */
+    int backlog;
+    int waiting;
+    /* 生成器命令因为 backlog 超过上限暂停, 降下来以后由连接所在的 I/O 线程 cli_resume */
+    int parked;
+    int done;
+    int error;
+    cli_output_overflow_t overflow;
+    uint32_t request_id;
+    int len;
+    char line[];
+} cli_job_t;
+
+/* 唤醒 s 的 I/O 线程处理 events, main_jobs 或 woken 队列. 需要持有 s->lock */
+static void cli_server_signal (cli_server_t *s)
+{
+    uint64_t v = 1;
+
+    /* 先置标志再写 eventfd, I/O 线程看到 eventfd 可读时一定能看到标志 */
+    if (!s->worker_event_signaled) {
+        __atomic_store_n(&s->worker_event_signaled, 1, __ATOMIC_RELEASE);
+        if (write(s->worker_event_fd, &v, sizeof(v)) != sizeof(v))
+            s->worker_event_signaled = 0;
+    }
+}
+
+/* 把 job 放入 events 队列并唤醒 I/O 线程. 需要持有 s->lock */
+static void cli_job_post (cli_server_t *s, cli_job_t *job)
+{
+    if (job->on_events)
+        return;
+    job->on_events = 1;
+    job->event_next = 0;
+    if (s->events_tail)
+        s->events_tail->event_next = job;
+    else
+        s->events_head = job;
+    s->events_tail = job;
+    cli_server_signal(s);
+}
+
+/* 把 job->out 中的输出交给 I/O 线程, 不等待. 需要持有 s->lock */
+static void cli_job_handoff (cli_server_t *s, cli_job_t *job)
+{
+    cli_output_queue_t *q = &job->out;
+
+    if (q->pending) {
+        job->backlog += q->pending;
+        cli_output_queue_splice(&job->handoff, q);
+        cli_job_post(s, job);
+    }
+}
+
+/*
+ * 工作线程中输出队列的发送函数: 把输出交给 I/O 线程.
+ * 连接的待发送数据超过上限时按连接的 overflow 处理: PAUSE 等待 I/O 线程发出去, CLOSE 直接出错.
+ * 转交给 0 号分片的请求(q->wake 不为 0)在 I/O 线程上执行, 不能等待, 生成器命令由 cli_job_park 暂停.
+ */
+static int cli_job_write (cli_output_queue_t *q, int wait)
+{
+    cli_job_t *job = (cli_job_t *) ((char *) q - offsetof(cli_job_t, out));
+    cli_server_t *s = job->server;
+
+    pthread_mutex_lock(&s->lock);
+    cli_job_handoff(s, job);
+    while (!q->wake && job->conn && !s->stopping && job->backlog > q->limit
+           && job->overflow == CLI_OUTPUT_OVERFLOW_PAUSE) {
+        job->waiting = 1;
+        pthread_cond_wait(&s->tx_cond, &s->lock);
+        job->waiting = 0;
+    }
+    if (!job->conn || s->stopping
+        || (job->backlog > q->limit && job->overflow == CLI_OUTPUT_OVERFLOW_CLOSE))
+        q->error = 1;
+    pthread_mutex_unlock(&s->lock);
+
+    return q->error ? -1 : 0;
+}
+
+/*
+ * 挂起的命令被 cli_resume 唤醒, 可能在任意线程调用.
+ * 放入 woken 队列, 由 I/O 线程在 cli_server_jobs_poll 中继续执行.
+ */
+static void cli_server_async_wake (void *owner, cli_async_t *a)
+{
+    cli_server_t *s = (cli_server_t *) owner;
+
+    pthread_mutex_lock(&s->lock);
+    a->wake_next = 0;
+    if (s->woken_tail)
+        s->woken_tail->wake_next = a;
+    else
+        s->woken_head = a;
+    s->woken_tail = a;
+    cli_server_signal(s);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* 队列 q 上的请求挂起了, user 为请求所属的连接或者 cli_job_t */
+static void cli_server_async_link (cli_server_t *s, cli_async_t *a, void *user)
+{
+    a->user = user;
+    a->prev = 0;
+    a->next = s->suspended;
+    if (s->suspended)
+        s->suspended->prev = a;
+    s->suspended = a;
+}
+
+static void cli_server_async_unlink (cli_server_t *s, cli_async_t *a)
+{
+    if (a->prev)
+        a->prev->next = a->next;
+    else
+        s->suspended = a->next;
+    if (a->next)
+        a->next->prev = a->prev;
+}
+
+/* 有请求在工作线程执行或者挂起, 完成之前不能执行后面的请求 */
+static int cli_conn_busy (cli_conn_t *conn)
+{
+    return conn->job || conn->tx.async;
+}
+
+/*
+ * 把请求交给其它线程执行, 返回 1; 需要在当前线程执行时返回 0.
+ * 有工作线程时交出线程安全的请求; 在分片上则相反, 线程安全的请求直接在分片线程执行,
+ * 其它请求交给 0 号分片.
+ */
+static int cli_job_submit (cli_server_t *s, cli_conn_t *conn, uint32_t request_id,
+                           const char *line, int len)
+{
+    cli_server_t *target = s->main ? s->main : s;
+    cli_job_t *job;
+    int safe;
+
+    if (!s->snapshot)
+        return 0;
+    safe = cli_request_thread_safe(s->snapshot, line, len);
+    if (s->main ? safe : !safe)
+        return 0;
+    if (!(job = (cli_job_t *) calloc(1, sizeof(cli_job_t) + len)))
+        return 0;
+
+    job->server = s;
+    job->conn = conn;
+    job->out.limit = conn->tx.limit ? conn->tx.limit : CLI_CONN_TX_LIMIT;
+    job->out.write = cli_job_write;
+    job->overflow = conn->tx.overflow;
+    job->request_id = request_id;
+    job->len = len;
+    memcpy(job->line, line, len);
+
+    pthread_mutex_lock(&target->lock);
+    if (s->main) {
+        if (target->main_jobs_tail)
+            target->main_jobs_tail->next = job;
+        else
+            target->main_jobs_head = job;
+        target->main_jobs_tail = job;
+        cli_server_signal(target);
+    } else {
+        if (s->jobs_tail)
+            s->jobs_tail->next = job;
+        else
+            s->jobs_head = job;
+        s->jobs_tail = job;
+        pthread_cond_signal(&s->jobs_cond);
+    }
+    pthread_mutex_unlock(&target->lock);
+
+    conn->job = job;
+    cli_server_stats->offloaded++;
+    return 1;
+}
+
+cli_conn_t *cli_conn_create (int epoll_fd, int fd)
+{
+    cli_conn_t *conn = (cli_conn_t *) calloc(1, sizeof(cli_conn_t));
+    struct epoll_event ev;
+
+    if (!conn)
+        return 0;
+
+    conn->fd = fd;
+    conn->epoll_fd = epoll_fd;
+    conn->tx.limit = CLI_CONN_TX_LIMIT;
+    conn->tx.overflow = CLI_OUTPUT_OVERFLOW_PAUSE;
+
+    conn->events = EPOLLIN | EPOLLET;
+    ev.events = conn->events;
+    ev.data.ptr = conn;
+    cli_server_stats->syscalls++;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        free(conn);
+        return 0;
+    }
+
+    return conn;
+}
+
+void cli_conn_free (cli_conn_t *conn)
+{
+    if (conn->epoll_fd >= 0) {
+        cli_server_stats->syscalls++;
+        epoll_ctl(conn->epoll_fd, EPOLL_CTL_DEL, conn->fd, 0);
+    }
+    cli_server_stats->syscalls++;
+    close(conn->fd);
+    cli_output_queue_discard(&conn->tx);
+    free(conn->rx_buffer);
+    free(conn);
+}
+
+static uint64_t cli_server_now (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* 预算是否已经用完 */
+static int cli_budget_exhausted (cli_budget_t *budget)
+{
+    if (!budget)
+        return 0;
+    if (budget->commands <= 0)
+        return 1;
+    return budget->deadline && cli_server_now() >= budget->deadline;
+}
+
+/* 待发送的数据超过上限 */
+static int cli_conn_tx_full (cli_conn_t *conn)
+{
+    return conn->tx.pending > conn->tx.limit;
+}
+
+/*
+ * 执行接收缓冲中完整的帧, 剩下的数据移到缓冲开头.
+ * 待发送的数据超过上限, 预算用完, 有请求交给了工作线程或者挂起时停下, 剩下的请求之后再执行.
+ * 没有执行完的生成器命令先于后面的请求继续.
+ */
+static int cli_conn_process (cli_conn_t *conn, cli_budget_t *budget)
+{
+    cli_server_t *s = conn->server;
+    cli_frame_header_t h;
+    int off = 0, error = 0;
+    cli_async_t *a;
+    char *line;
+
+    while (!cli_conn_tx_full(conn) && !conn->job) {
+        if (conn->tx.error) {
+            error = -1;
+            break;
+        }
+
+        /* 生成器命令: 发送队列有空间时继续输出下一段, 每段消耗一个预算 */
+        if ((a = conn->tx.async)) {
+            if (!a->more || cli_budget_exhausted(budget))
+                break;
+            if (budget)
+                budget->commands--;
+            if (cli_async_continue(a) && !a->more)
+                cli_server_async_link(s, a, conn);
+            continue;
+        }
+
+        if (conn->rx_len - off < CLI_FRAME_HEADER_SIZE)
+            break;
+        cli_frame_header_decode(conn->rx_buffer + off, &h);
+
+        /* 只接受 REQUEST 帧, 长度不合法时认为对端出错 */
+        if (h.length > CLI_FRAME_MAX_PAYLOAD || h.type != CLI_FRAME_REQUEST) {
+            error = -1;
+            break;
+        }
+        if (conn->rx_len - off < CLI_FRAME_HEADER_SIZE + (int) h.length)
+            break;
+        if (cli_budget_exhausted(budget))
+            break;
+        if (budget)
+            budget->commands--;
+
+        cli_server_stats->commands++;
+        line = conn->rx_buffer + off + CLI_FRAME_HEADER_SIZE;
+        off += CLI_FRAME_HEADER_SIZE + h.length;
+        if (s && (s->n_workers || s->main) && cli_job_submit(s, conn, h.request_id, line, h.length))
+            continue;
+        /* 分片线程不能读主线程正在修改的 cm.commands, 使用快照 */
+        if (s && s->main && s->snapshot)
+            error = cli_request_snapshot(s->snapshot, &conn->tx, conn->fd, h.request_id, line, h.length);
+        else
+            error = cli_request(&conn->tx, conn->fd, h.request_id, line, h.length);
+        if (error)
+            break;
+        /* 命令挂起, 等 cli_resume 之后继续; 生成器在下一轮循环继续 */
+        if (conn->tx.async && !conn->tx.async->more)
+            cli_server_async_link(s, conn->tx.async, conn);
+    }
+
+    if (off) {
+        memmove(conn->rx_buffer, conn->rx_buffer + off, conn->rx_len - off);
+        conn->rx_len -= off;
+    }
+
+    return error;
+}
+
+/* 保证接收缓冲中至少有 n 字节空闲 */
+static int cli_conn_rx_reserve (cli_conn_t *conn, int n)
+{
+    int capacity;
+    char *p;
+
+    if (conn->rx_capacity - conn->rx_len >= n)
+        return 0;
+
+    capacity = conn->rx_capacity ? conn->rx_capacity << 1 : CLI_CONN_READ_SIZE;
+    while (capacity - conn->rx_len < n)
+        capacity <<= 1;
+    p = (char *) realloc(conn->rx_buffer, capacity);
+    if (!p)
+        return -1;
+    conn->rx_buffer = p;
+    conn->rx_capacity = capacity;
+    return 0;
+}
+
+/* 从 fd 读数据到接收缓冲, 返回读到的字节数, 没有数据返回 -EAGAIN, 对端关闭返回 0 */
+static int cli_conn_read (cli_conn_t *conn)
+{
+    ssize_t n;
+
+    if (cli_conn_rx_reserve(conn, CLI_CONN_READ_SIZE))
+        return -ENOMEM;
+
+    do {
+        cli_server_stats->syscalls++;
+        n = read(conn->fd, conn->rx_buffer + conn->rx_len, conn->rx_capacity - conn->rx_len);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0)
+        return errno == EWOULDBLOCK ? -EAGAIN : -errno;
+
+    conn->rx_len += n;
+    return n;
+}
+
+/* 只在有数据待发送时注册 EPOLLOUT */
+static int cli_conn_update_events (cli_conn_t *conn)
+{
+    uint32_t events = EPOLLIN | EPOLLET | (conn->tx.pending ? EPOLLOUT : 0);
+    struct epoll_event ev;
+
+    if (events == conn->events)
+        return 0;
+
+    ev.events = events;
+    ev.data.ptr = conn;
+    cli_server_stats->syscalls++;
+    if (epoll_ctl(conn->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) < 0)
+        return -1;
+    conn->events = events;
+    return 0;
+}
+
+int cli_conn_event (cli_conn_t *conn, uint32_t events, cli_budget_t *budget)
+{
+    int more = 0;
+
+    if ((events & EPOLLERR) || conn->tx.error)
+        return -1;
+
+    /*
+     * 边缘触发: 每次都要把能读的数据读完.
+     * 暂停期间不读, 恢复时(EPOLLOUT 把数据发出去之后)先执行缓冲中的请求再继续读到 EAGAIN.
+     */
+    while (1) {
+        int n;
+
+        if (cli_output_queue_write(conn->fd, &conn->tx))
+            return -1;
+
+        if (cli_conn_tx_full(conn)) {
+            if (conn->tx.overflow == CLI_OUTPUT_OVERFLOW_CLOSE)
+                return -1;
+            break;
+        }
+
+        if (cli_conn_process(conn, budget))
+            return -1;
+        if (cli_conn_tx_full(conn))
+            continue;
+
+        /* 预算用完, 缓冲和 socket 中剩下的请求下次再处理 */
+        if (cli_budget_exhausted(budget)) {
+            more = 1;
+            break;
+        }
+
+        /* 等工作线程执行完或者挂起的命令完成再继续读, 只预读一部分 */
+        if (conn->eof || (cli_conn_busy(conn) && conn->rx_len >= CLI_CONN_RX_LIMIT))
+            break;
+
+        n = cli_conn_read(conn);
+        if (n == -EAGAIN)
+            break;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            conn->eof = 1;
+    }
+
+    if (cli_output_queue_write(conn->fd, &conn->tx))
+        return -1;
+
+    /* 对端不再发送请求, 回复也都发送完了 */
+    if (!more && conn->eof && conn->tx.pending == 0 && !cli_conn_busy(conn))
+        return -1;
+
+    if (cli_conn_update_events(conn))
+        return -1;
+    return more;
+}
+
+/* 服务端 */
+
+static void cli_server_ready_add (cli_server_t *s, cli_conn_t *conn)
+{
+    if (conn->is_ready)
+        return;
+    conn->is_ready = 1;
+    conn->ready_next = 0;
+    if (s->ready_tail)
+        s->ready_tail->ready_next = conn;
+    else
+        s->ready_head = conn;
+    s->ready_tail = conn;
+}
+
+static cli_conn_t *cli_server_ready_pop (cli_server_t *s)
+{
+    cli_conn_t *conn = s->ready_head;
+
+    if (conn) {
+        s->ready_head = conn->ready_next;
+        if (!s->ready_head)
+            s->ready_tail = 0;
+        conn->is_ready = 0;
+    }
+    return conn;
+}
+
+static void cli_server_conn_link (cli_server_t *s, cli_conn_t *conn)
+{
+    cli_sched_t *sched = &(s->main ? s->main : s)->sched;
+    int quantum = sched->quantum;
+
+    if (sched->conn_quantum && (quantum = sched->conn_quantum(conn->fd, quantum)) <= 0)
+        quantum = sched->quantum;
+    conn->quantum = sched->mode == CLI_SCHED_TIME ? (int64_t) quantum * 1000 : quantum;
+    conn->deficit = 0;
+
+    conn->prev = 0;
+    conn->next = s->conns;
+    if (s->conns)
+        s->conns->prev = conn;
+    s->conns = conn;
+    cli_server_stats->connections++;
+}
+
+/*
+ * 连接关闭时, 正在执行的请求与连接脱离, 工作线程执行完后由 cli_server_jobs_poll 释放;
+ * 挂起的请求之后的输出都丢弃, 继续执行完后释放.
+ */
+static void cli_server_conn_detach (cli_server_t *s, cli_conn_t *conn)
+{
+    cli_job_t *job = conn->job;
+    int parked;
+
+    if (conn->tx.async) {
+        conn->tx.async->user = 0;
+        cli_async_detach(conn->tx.async);
+    }
+    if (!job)
+        return;
+    pthread_mutex_lock(&s->lock);
+    job->conn = 0;
+    if (job->waiting)
+        pthread_cond_broadcast(&s->tx_cond);
+    parked = job->parked;
+    job->parked = 0;
+    pthread_mutex_unlock(&s->lock);
+    conn->job = 0;
+
+    /* 暂停的生成器继续执行, 看到连接已经关闭后结束 */
+    if (parked)
+        cli_resume(job->out.async);
+}
+
+static void cli_server_conn_unlink (cli_server_t *s, cli_conn_t *conn)
+{
+    if (conn->prev)
+        conn->prev->next = conn->next;
+    else
+        s->conns = conn->next;
+    if (conn->next)
+        conn->next->prev = conn->prev;
+    cli_server_conn_detach(s, conn);
+}
+
+/* 工作线程 */
+
+/* 请求执行完, 剩下的输出和完成事件交给请求所属的服务端 */
+static void cli_job_finish (cli_job_t *job)
+{
+    cli_server_t *s = job->server;
+
+    if (!job->out.error)
+        cli_job_write(&job->out, 0);
+
+    pthread_mutex_lock(&s->lock);
+    job->error = job->out.error;
+    cli_output_queue_discard(&job->out);
+    job->done = 1;
+    cli_job_post(s, job);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * 交出生成器已经输出的部分. 连接的待发送数据超过上限时暂停生成器, 返回 1,
+ * 不像 cli_job_write 那样在这里等待, 执行它的 I/O 线程可以继续处理其它连接.
+ */
+static int cli_job_park (cli_job_t *job)
+{
+    cli_server_t *s = job->server;
+    cli_output_queue_t *q = &job->out;
+    int parked = 0;
+
+    pthread_mutex_lock(&s->lock);
+    cli_job_handoff(s, job);
+    if (!job->conn || s->stopping)
+        q->error = 1;
+    else if (job->backlog > q->limit)
+        parked = job->parked = 1;
+    pthread_mutex_unlock(&s->lock);
+
+    return parked;
+}
+
+/*
+ * 生成器命令在这里连续执行到结束或者挂起, 输出随时交回连接所在的 I/O 线程.
+ * 工作线程中由 cli_job_write 等待限流, 在 I/O 线程中执行时超过上限就暂停(cli_job_park).
+ * 请求结束时返回 1, 挂起或暂停时返回 0.
+ */
+static int cli_job_continue (cli_job_t *job)
+{
+    cli_async_t *a;
+
+    while ((a = job->out.async) && a->more) {
+        /* 连接已经关闭, 生成器不再继续 */
+        if (job->out.error) {
+            cli_async_detach(a);
+            break;
+        }
+        if (job->out.wake && cli_job_park(job))
+            return 0;
+        cli_async_continue(a);
+    }
+    if (job->out.async)
+        return 0;
+    cli_job_finish(job);
+    return 1;
+}
+
+/*
+ * 在快照 snap 上执行请求, 返回值与 cli_job_continue 相同; 请求结束后 job 随时可能被释放.
+ * 在 I/O 线程执行时命令可以挂起, 由 cli_server_async_continue 结束.
+ */
+static int cli_job_run (cli_job_t *job, cli_snapshot_t *snap)
+{
+    cli_request_snapshot(snap, &job->out, -1, job->request_id, job->line, job->len);
+    return cli_job_continue(job);
+}
+
+/* 在 I/O 线程上继续执行被唤醒的命令, 完成后让请求所属的连接继续 */
+static void cli_server_async_continue (cli_server_t *s, cli_async_t *a)
+{
+    cli_output_queue_t *q = a->ctx.output;
+    cli_conn_t *conn = 0;
+    cli_job_t *job = 0;
+
+    if (a->user && q->write == cli_job_write)
+        job = (cli_job_t *) a->user;
+    else
+        conn = (cli_conn_t *) a->user;
+
+    cli_server_async_unlink(s, a);
+    if (job) {
+        cli_async_continue(a);
+        if (!cli_job_continue(job))
+            cli_server_async_link(s, job->out.async, job);
+        return;
+    }
+    if (cli_async_continue(a)) {
+        if (!a->more) {
+            cli_server_async_link(s, a, conn);
+            return;
+        }
+        /* 连接已经关闭, 生成器不再继续 */
+        if (!conn) {
+            cli_async_detach(a);
+            return;
+        }
+    }
+
+    /* 请求完成或者变成了生成器, 连接继续 */
+    if (conn) {
+        conn->ready_events |= EPOLLOUT;
+        cli_server_ready_add(s, conn);
+    }
+}
+
+static void *cli_server_worker (void *arg)
+{
+    cli_server_t *s = (cli_server_t *) arg;
+    cli_snapshot_t *snap = 0;
+    cli_thread_t thread;
+    cli_job_t *job;
+
+    cli_thread_register(&thread);
+
+    pthread_mutex_lock(&s->lock);
+    while (1) {
+        while (!s->jobs_head && !s->stopping)
+            pthread_cond_wait(&s->jobs_cond, &s->lock);
+        if (s->stopping)
+            break;
+        job = s->jobs_head;
+        s->jobs_head = job->next;
+        if (!s->jobs_head)
+            s->jobs_tail = 0;
+        pthread_mutex_unlock(&s->lock);
+
+        /* 主线程 cli_freeze 之后切换到新的快照 */
+        snap = cli_snapshot_refresh(snap);
+        cli_job_run(job, snap);
+        pthread_mutex_lock(&s->lock);
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    if (snap)
+        cli_snapshot_release(snap);
+    cli_thread_unregister(&thread);
+    return 0;
+}
+
+/*
+ * 取走其它线程交回的输出和完成的请求.
+ * 输出追加到连接的发送队列, 请求完成后连接继续执行后面的请求.
+ * 0 号分片还要执行其它分片转交过来的请求.
+ */
+static void cli_server_jobs_poll (cli_server_t *s)
+{
+    cli_job_t *job, *next, *main_jobs;
+    cli_async_t *a, *woken;
+    cli_conn_t *conn;
+    int *incoming, n_incoming, i;
+    uint64_t v;
+
+    if (!__atomic_load_n(&s->worker_event_signaled, __ATOMIC_ACQUIRE))
+        return;
+
+    pthread_mutex_lock(&s->lock);
+    cli_server_stats->syscalls++;
+    if (read(s->worker_event_fd, &v, sizeof(v)) == sizeof(v))
+        s->worker_event_signaled = 0;
+
+    for (job = s->events_head; job; job = next) {
+        next = job->event_next;
+        job->on_events = 0;
+
+        if ((conn = job->conn)) {
+            cli_output_queue_splice(&conn->tx, &job->handoff);
+            if (job->error)
+                conn->tx.error = 1;
+            job->backlog = conn->tx.pending;
+            conn->ready_events |= EPOLLOUT;
+            cli_server_ready_add(s, conn);
+        }
+        if (job->done) {
+            if (conn)
+                conn->job = 0;
+            cli_output_queue_discard(&job->handoff);
+            free(job);
+        }
+    }
+    s->events_head = s->events_tail = 0;
+    main_jobs = s->main_jobs_head;
+    s->main_jobs_head = s->main_jobs_tail = 0;
+    woken = s->woken_head;
+    s->woken_head = s->woken_tail = 0;
+    incoming = s->incoming;
+    n_incoming = s->n_incoming;
+    s->incoming = 0;
+    s->n_incoming = s->incoming_capacity = 0;
+    pthread_mutex_unlock(&s->lock);
+
+    for (i = 0; i < n_incoming; i++)
+        cli_server_conn_add(s, incoming[i]);
+    free(incoming);
+
+    /* 转交过来的请求在这里执行, 命令可以挂起 */
+    for (job = main_jobs; job; job = next) {
+        next = job->next;
+        job->out.wake = cli_server_async_wake;
+        job->out.owner = s;
+        if (!cli_job_run(job, s->snapshot))
+            cli_server_async_link(s, job->out.async, job);
+    }
+
+    while ((a = woken)) {
+        woken = a->wake_next;
+        cli_server_async_continue(s, a);
+    }
+}
+
+/* 连接的发送队列有变化后更新在途请求的 backlog, 降到上限以下时唤醒等待的工作线程 */
+static void cli_server_job_update (cli_server_t *s, cli_conn_t *conn)
+{
+    cli_job_t *job = conn->job;
+    int resume = 0;
+
+    pthread_mutex_lock(&s->lock);
+    job->backlog = conn->tx.pending + job->handoff.pending;
+    if (job->waiting && job->backlog <= job->out.limit)
+        pthread_cond_broadcast(&s->tx_cond);
+    if (job->parked && job->backlog <= job->out.limit) {
+        job->parked = 0;
+        resume = 1;
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    if (resume)
+        cli_resume(job->out.async);
+}
+
+/*
+ * 接受了一个新连接. 有多个分片时按顺序轮流分给各个分片, 不属于自己的交给对应分片的线程:
+ * AF_UNIX 没有 SO_REUSEPORT 那样的负载均衡, EPOLLEXCLUSIVE 和 io_uring 的 accept 往往总是唤醒同一个分片.
+ */
+static void cli_server_accepted (cli_server_t *s, int fd)
+{
+    cli_server_t *main = s->main ? s->main : s, *target = s;
+    int i;
+
+    if (main->n_shards) {
+        i = (unsigned) __atomic_fetch_add(&main->accept_seq, 1, __ATOMIC_RELAXED) % (main->n_shards + 1);
+        target = i ? main->shards[i - 1] : main;
+    }
+    if (target == s) {
+        cli_server_conn_add(s, fd);
+        return;
+    }
+
+    pthread_mutex_lock(&target->lock);
+    if (target->n_incoming == target->incoming_capacity) {
+        int capacity = target->incoming_capacity ? target->incoming_capacity << 1 : 16;
+        int *p = (int *) realloc(target->incoming, capacity * sizeof(int));
+
+        if (!p) {
+            pthread_mutex_unlock(&target->lock);
+            close(fd);
+            return;
+        }
+        target->incoming = p;
+        target->incoming_capacity = capacity;
+    }
+    target->incoming[target->n_incoming++] = fd;
+    cli_server_signal(target);
+    pthread_mutex_unlock(&target->lock);
+}
+
+#ifdef CLI_USE_IO_URING
+
+/* SQ 的大小, CQ 为它的 4 倍 */
+#define CLI_URING_ENTRIES 256
+/* 接收使用的 provided buffer, 个数需为 2 的幂 */
+#define CLI_URING_BUFFERS 256
+#define CLI_URING_BUFFER_SIZE 4096
+#define CLI_URING_BGID 0
+/* 一次 sendmsg 最多提交的输出段数 */
+#define CLI_URING_SEND_IOV 16
+
+/* user_data 的低 3 位为操作类型, 其余位为连接指针 */
+#define foreach_cli_uring_op                    \
+  _(ACCEPT, 1)                                  \
+  _(RECV, 2)                                    \
+  _(SEND, 3)                                    \
+  _(CANCEL, 4)
+
+typedef enum
+{
+#define _(n, v) CLI_URING_OP_##n = v,
+  foreach_cli_uring_op
+#undef _
+} cli_uring_op_t;
+
+#define CLI_URING_OP_MASK 7
+
+typedef struct cli_uring_t
+{
+    int fd;
+
+    /* 提交队列; 没有使用 SQPOLL, sq_tail 只有这里会写 */
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_flags;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    /* 已经填写还没有提交给内核的 SQE 数 */
+    unsigned sq_pending;
+
+    /* 完成队列 */
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    /* provided buffer ring, 接收的数据拷贝到连接的接收缓冲后马上归还 */
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    char *buffers;
+    unsigned short buf_tail;
+
+    /* 多次触发的 accept 还有效 */
+    int accept_armed;
+
+    /* 命令执行中等待发送完成时收到的其它完成事件, 下次 cli_server_process 时处理 */
+    struct io_uring_cqe *deferred;
+    int n_deferred;
+    int deferred_capacity;
+} cli_uring_t;
+
+/* io_uring 后端的连接 */
+typedef struct
+{
+    cli_conn_t conn;
+    cli_server_t *server;
+    /* 已经提交还没有完成的 recv/send 数, 为 0 时才能释放连接 */
+    int ops;
+    /* 多次触发的 recv 还有效, 以及为了暂停接收已经提交了取消 */
+    int recv_armed;
+    int recv_cancelled;
+    /* 在途 sendmsg 的字节数, 为 0 表示没有在途的发送 */
+    int send_len;
+    int closing;
+    int error;
+    struct iovec iov[CLI_URING_SEND_IOV];
+    struct msghdr msg;
+} cli_uring_conn_t;
+
+static void cli_uring_reap (cli_server_t *s, cli_uring_conn_t *only);
+
+/* 有生成器命令等着输出下一段 */
+static int cli_conn_more (cli_conn_t *conn)
+{
+    return conn->tx.async && conn->tx.async->more;
+}
+
+/* 接收缓冲中是否有完整的帧(或者不合法的帧头) */
+static int cli_conn_rx_ready (cli_conn_t *conn)
+{
+    cli_frame_header_t h;
+
+    if (conn->rx_len < CLI_FRAME_HEADER_SIZE)
+        return 0;
+    cli_frame_header_decode(conn->rx_buffer, &h);
+    return h.length > CLI_FRAME_MAX_PAYLOAD
+        || conn->rx_len >= CLI_FRAME_HEADER_SIZE + (int) h.length;
+}
+
+static int cli_uring_enter (cli_uring_t *u, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    int rv;
+
+    do {
+        cli_server_stats->syscalls++;
+        rv = syscall(__NR_io_uring_enter, u->fd, to_submit, min_complete, flags, 0, 0);
+    } while (rv < 0 && errno == EINTR);
+
+    return rv;
+}
+
+/* 提交填写好的 SQE; min_complete 不为 0 时等待完成事件 */
+static int cli_uring_submit (cli_uring_t *u, unsigned min_complete)
+{
+    unsigned flags = 0;
+    int rv;
+
+    /* CQ 溢出时内核暂存的完成事件要通过 GETEVENTS 取回 */
+    if (min_complete || (__atomic_load_n(u->sq_flags, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW))
+        flags |= IORING_ENTER_GETEVENTS;
+    if (!u->sq_pending && !flags)
+        return 0;
+
+    rv = cli_uring_enter(u, u->sq_pending, min_complete, flags);
+    if (rv < 0)
+        return errno == EBUSY || errno == EAGAIN ? 0 : -1;
+    u->sq_pending -= rv;
+    return 0;
+}
+
+static struct io_uring_sqe *cli_uring_get_sqe (cli_uring_t *u)
+{
+    unsigned tail = *u->sq_tail, index;
+    struct io_uring_sqe *sqe;
+
+    if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+        if (cli_uring_submit(u, 0))
+            return 0;
+        if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries)
+            return 0;
+    }
+
+    /* 内核只在 io_uring_enter 时读 SQ, 先发布再填写也没有问题 */
+    index = tail & *u->sq_mask;
+    sqe = &u->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[index] = index;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->sq_pending++;
+    return sqe;
+}
+
+static void cli_uring_buffer_add (cli_uring_t *u, unsigned short bid)
+{
+    struct io_uring_buf *b = &u->buf_ring->bufs[u->buf_tail & (CLI_URING_BUFFERS - 1)];
+
+    b->addr = (uint64_t) (uintptr_t) (u->buffers + (size_t) bid * CLI_URING_BUFFER_SIZE);
+    b->len = CLI_URING_BUFFER_SIZE;
+    b->bid = bid;
+    u->buf_tail++;
+    __atomic_store_n(&u->buf_ring->tail, u->buf_tail, __ATOMIC_RELEASE);
+}
+
+static void cli_uring_destroy (cli_uring_t *u)
+{
+    if (u->buf_ring && u->buf_ring != MAP_FAILED)
+        munmap(u->buf_ring, u->buf_ring_size);
+    if (u->sqes && u->sqes != MAP_FAILED)
+        munmap(u->sqes, u->sqes_size);
+    if (u->cq_ring && u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring)
+        munmap(u->cq_ring, u->cq_ring_size);
+    if (u->sq_ring && u->sq_ring != MAP_FAILED)
+        munmap(u->sq_ring, u->sq_ring_size);
+    if (u->fd >= 0)
+        close(u->fd);
+    free(u->buffers);
+    free(u->deferred);
+    free(u);
+}
+
+/* 创建 io_uring 并注册 provided buffer, 内核不支持时返回 0 */
+static cli_uring_t *cli_uring_create (void)
+{
+    cli_uring_t *u = (cli_uring_t *) calloc(1, sizeof(cli_uring_t));
+    struct io_uring_buf_reg reg;
+    struct io_uring_params p;
+    char *sq, *cq;
+    int i;
+
+    if (!u)
+        return 0;
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL;
+    p.cq_entries = 4 * CLI_URING_ENTRIES;
+    if ((u->fd = syscall(__NR_io_uring_setup, CLI_URING_ENTRIES, &p)) < 0)
+        goto fail;
+    if (!(p.features & IORING_FEAT_NODROP))
+        goto fail;
+
+    u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_ring_size > u->sq_ring_size)
+            u->sq_ring_size = u->cq_ring_size;
+        u->cq_ring_size = u->sq_ring_size;
+    }
+
+    u->sq_ring = mmap(0, u->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED)
+        goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        u->cq_ring = u->sq_ring;
+    else {
+        u->cq_ring = mmap(0, u->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          u->fd, IORING_OFF_CQ_RING);
+        if (u->cq_ring == MAP_FAILED)
+            goto fail;
+    }
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = (struct io_uring_sqe *) mmap(0, u->sqes_size, PROT_READ | PROT_WRITE,
+                                           MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED)
+        goto fail;
+
+    sq = (char *) u->sq_ring;
+    cq = (char *) u->cq_ring;
+    u->sq_head = (unsigned *) (sq + p.sq_off.head);
+    u->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    u->sq_flags = (unsigned *) (sq + p.sq_off.flags);
+    u->sq_array = (unsigned *) (sq + p.sq_off.array);
+    u->sq_entries = p.sq_entries;
+    u->cq_head = (unsigned *) (cq + p.cq_off.head);
+    u->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    /* buffer ring 需要页对齐 */
+    u->buf_ring_size = CLI_URING_BUFFERS * sizeof(struct io_uring_buf);
+    u->buf_ring = (struct io_uring_buf_ring *) mmap(0, u->buf_ring_size, PROT_READ | PROT_WRITE,
+                                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (u->buf_ring == MAP_FAILED)
+        goto fail;
+    if (!(u->buffers = (char *) malloc((size_t) CLI_URING_BUFFERS * CLI_URING_BUFFER_SIZE)))
+        goto fail;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) u->buf_ring;
+    reg.ring_entries = CLI_URING_BUFFERS;
+    reg.bgid = CLI_URING_BGID;
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        goto fail;
+    for (i = 0; i < CLI_URING_BUFFERS; i++)
+        cli_uring_buffer_add(u, i);
+
+    return u;
+
+fail:
+    cli_uring_destroy(u);
+    return 0;
+}
+
+static int cli_uring_arm_accept (cli_server_t *s)
+{
+    struct io_uring_sqe *sqe = cli_uring_get_sqe(s->uring);
+
+    if (!sqe)
+        return -1;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = s->listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = CLI_URING_OP_ACCEPT;
+    s->uring->accept_armed = 1;
+    return 0;
+}
+
+static int cli_uring_arm_recv (cli_uring_conn_t *uc)
+{
+    struct io_uring_sqe *sqe = cli_uring_get_sqe(uc->server->uring);
+
+    if (!sqe)
+        return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = uc->conn.fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = CLI_URING_BGID;
+    sqe->user_data = (uint64_t) (uintptr_t) uc | CLI_URING_OP_RECV;
+    uc->recv_armed = 1;
+    uc->recv_cancelled = 0;
+    uc->ops++;
+    return 0;
+}
+
+/* 暂停接收: 取消多次触发的 recv, 发送队列降下来之后重新提交 */
+static int cli_uring_cancel_recv (cli_uring_conn_t *uc)
+{
+    struct io_uring_sqe *sqe = cli_uring_get_sqe(uc->server->uring);
+
+    if (!sqe)
+        return -1;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uint64_t) (uintptr_t) uc | CLI_URING_OP_RECV;
+    sqe->user_data = CLI_URING_OP_CANCEL;
+    uc->recv_cancelled = 1;
+    return 0;
+}
+
+/*
+ * 用一个 sendmsg 提交输出队列开头的若干段, 完成之前不再提交, 这样同一个连接上的发送总是有序的.
+ * 在途期间命令可以继续在队列尾部追加输出, 已经提交的字节不会被修改.
+ */
+static int cli_uring_send (cli_uring_conn_t *uc)
+{
+    cli_output_queue_t *q = &uc->conn.tx;
+    struct io_uring_sqe *sqe;
+    cli_output_segment_t *seg;
+    int n_iov = 0, len = 0;
+
+    for (seg = q->head; seg && n_iov < CLI_URING_SEND_IOV; seg = seg->next) {
+        if (seg->len == seg->start)
+            continue;
+        uc->iov[n_iov].iov_base = seg->data + seg->start;
+        uc->iov[n_iov].iov_len = seg->len - seg->start;
+        len += seg->len - seg->start;
+        n_iov++;
+    }
+    if (!n_iov)
+        return 0;
+
+    if (!(sqe = cli_uring_get_sqe(uc->server->uring)))
+        return -1;
+    memset(&uc->msg, 0, sizeof(uc->msg));
+    uc->msg.msg_iov = uc->iov;
+    uc->msg.msg_iovlen = n_iov;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = uc->conn.fd;
+    sqe->addr = (uint64_t) (uintptr_t) &uc->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = (uint64_t) (uintptr_t) uc | CLI_URING_OP_SEND;
+    uc->send_len = len;
+    uc->ops++;
+    return 0;
+}
+
+/*
+ * 输出队列的发送函数(cli_output_queue_t.write): 提交发送, 不直接 writev, 否则会和在途的发送乱序.
+ * wait 不为 0 时(命令执行中输出超过上限)等待这个连接的发送完成, 其它完成事件留到下次处理.
+ */
+static int cli_uring_conn_write (cli_output_queue_t *q, int wait)
+{
+    cli_uring_conn_t *uc = (cli_uring_conn_t *) ((char *) q - offsetof(cli_uring_conn_t, conn.tx));
+
+    if (q->error || uc->error)
+        return -1;
+    if (!uc->send_len && cli_uring_send(uc))
+        return -1;
+    if (!wait)
+        return 0;
+
+    while (uc->send_len && !uc->error) {
+        if (cli_uring_submit(uc->server->uring, 1))
+            return -1;
+        cli_uring_reap(uc->server, uc);
+    }
+
+    return uc->error ? -1 : 0;
+}
+
+static void cli_uring_conn_free (cli_uring_conn_t *uc)
+{
+    cli_server_conn_unlink(uc->server, &uc->conn);
+    cli_conn_free(&uc->conn);
+}
+
+static void cli_uring_conn_create (cli_server_t *s, int fd)
+{
+    cli_uring_conn_t *uc = (cli_uring_conn_t *) calloc(1, sizeof(cli_uring_conn_t));
+
+    if (!uc) {
+        close(fd);
+        return;
+    }
+
+    uc->server = s;
+    uc->conn.server = s;
+    uc->conn.fd = fd;
+    uc->conn.epoll_fd = -1;
+    uc->conn.tx.limit = CLI_CONN_TX_LIMIT;
+    uc->conn.tx.overflow = CLI_OUTPUT_OVERFLOW_PAUSE;
+    uc->conn.tx.write = cli_uring_conn_write;
+    uc->conn.tx.wake = cli_server_async_wake;
+    uc->conn.tx.owner = s;
+    cli_server_conn_link(s, &uc->conn);
+
+    if (cli_uring_arm_recv(uc))
+        cli_uring_conn_free(uc);
+}
+
+/* 关闭连接: 取消所有在途的操作, 最后一个操作完成后释放 */
+static void cli_uring_conn_close (cli_uring_conn_t *uc)
+{
+    struct io_uring_sqe *sqe;
+
+    uc->closing = 1;
+    uc->conn.tx.error = 1;
+    cli_server_conn_detach(uc->server, &uc->conn);
+    if (!uc->ops) {
+        cli_uring_conn_free(uc);
+        return;
+    }
+
+    if ((sqe = cli_uring_get_sqe(uc->server->uring))) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = uc->conn.fd;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        sqe->user_data = CLI_URING_OP_CANCEL;
+    }
+}
+
+static void cli_uring_complete (cli_server_t *s, struct io_uring_cqe *cqe)
+{
+    cli_uring_t *u = s->uring;
+    cli_uring_conn_t *uc = (cli_uring_conn_t *) (uintptr_t) (cqe->user_data & ~(uint64_t) CLI_URING_OP_MASK);
+    cli_conn_t *conn = (cli_conn_t *) uc;
+
+    switch (cqe->user_data & CLI_URING_OP_MASK) {
+    case CLI_URING_OP_ACCEPT:
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+            u->accept_armed = 0;
+        if (cqe->res >= 0)
+            cli_server_accepted(s, cqe->res);
+        return;
+
+    case CLI_URING_OP_RECV:
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+            if (cqe->res > 0 && !uc->closing) {
+                if (cli_conn_rx_reserve(conn, cqe->res))
+                    uc->error = 1;
+                else {
+                    memcpy(conn->rx_buffer + conn->rx_len,
+                           u->buffers + (size_t) bid * CLI_URING_BUFFER_SIZE, cqe->res);
+                    conn->rx_len += cqe->res;
+                }
+            }
+            cli_uring_buffer_add(u, bid);
+        }
+        if (cqe->res == 0)
+            conn->eof = 1;
+        else if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED)
+            uc->error = 1;
+        /* 没有 F_MORE 表示这个 recv 已经结束, 需要时重新提交 */
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            uc->recv_armed = 0;
+            uc->ops--;
+        }
+        break;
+
+    case CLI_URING_OP_SEND:
+        uc->ops--;
+        uc->send_len = 0;
+        if (cqe->res < 0)
+            uc->error = 1;
+        else if (!uc->closing)
+            cli_output_queue_consume(&conn->tx, cqe->res);
+        break;
+
+    default:
+        return;
+    }
+
+    if (!uc->closing)
+        cli_server_ready_add(s, conn);
+    else if (!uc->ops)
+        cli_uring_conn_free(uc);
+}
+
+/* 处理 CQ 中的完成事件; only 不为 0 时只处理该连接的发送完成, 其它的暂存起来 */
+static void cli_uring_reap (cli_server_t *s, cli_uring_conn_t *only)
+{
+    cli_uring_t *u = s->uring;
+    unsigned head = *u->cq_head;
+    unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    uint64_t send = (uint64_t) (uintptr_t) only | CLI_URING_OP_SEND;
+
+    for (; head != tail; head++) {
+        struct io_uring_cqe cqe = u->cqes[head & *u->cq_mask];
+
+        if (only && cqe.user_data != send) {
+            if (u->n_deferred == u->deferred_capacity) {
+                int capacity = u->deferred_capacity ? u->deferred_capacity << 1 : 64;
+                struct io_uring_cqe *p = (struct io_uring_cqe *)
+                    realloc(u->deferred, capacity * sizeof(struct io_uring_cqe));
+
+                /* 内存不足时先不取这些事件, 留在 CQ 中 */
+                if (!p)
+                    break;
+                u->deferred = p;
+                u->deferred_capacity = capacity;
+            }
+            u->deferred[u->n_deferred++] = cqe;
+            continue;
+        }
+        /* 先释放 CQ 位置, 处理时可能再次进入内核 */
+        __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+        cli_uring_complete(s, &cqe);
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* 收集完成事件, 把有事件的连接加入就绪链表 */
+static void cli_uring_poll (cli_server_t *s)
+{
+    cli_uring_t *u = s->uring;
+    int i;
+
+    for (i = 0; i < u->n_deferred; i++)
+        cli_uring_complete(s, &u->deferred[i]);
+    u->n_deferred = 0;
+
+    cli_uring_reap(s, 0);
+
+    if (!u->accept_armed)
+        cli_uring_arm_accept(s);
+}
+
+/*
+ * 执行一个就绪连接中的请求, 并根据发送队列暂停或恢复接收.
+ * 返回值与 cli_conn_event 相同.
+ */
+static int cli_uring_conn_run (cli_uring_conn_t *uc, cli_budget_t *budget)
+{
+    cli_conn_t *conn = &uc->conn;
+    int more = 0;
+
+    if (uc->error || conn->tx.error)
+        return -1;
+
+    if (!cli_conn_tx_full(conn)) {
+        if (cli_conn_process(conn, budget))
+            return -1;
+        more = !cli_conn_tx_full(conn)
+               && (cli_conn_more(conn) || (!cli_conn_busy(conn) && cli_conn_rx_ready(conn)));
+    }
+
+    if (cli_conn_tx_full(conn) && conn->tx.overflow == CLI_OUTPUT_OVERFLOW_CLOSE)
+        return -1;
+    if (cli_conn_tx_full(conn) || (cli_conn_busy(conn) && conn->rx_len >= CLI_CONN_RX_LIMIT)) {
+        if (uc->recv_armed && !uc->recv_cancelled && cli_uring_cancel_recv(uc))
+            return -1;
+    } else if (!uc->recv_armed && !conn->eof) {
+        if (cli_uring_arm_recv(uc))
+            return -1;
+    }
+
+    if (!uc->send_len && conn->tx.pending && cli_uring_send(uc))
+        return -1;
+
+    /* 对端不再发送请求, 回复也都发送完了 */
+    if (conn->eof && !more && !conn->tx.pending && !cli_conn_busy(conn))
+        return -1;
+
+    return more;
+}
+
+#endif
+
+static int cli_server_listen (const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    unlink(path);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* 所有服务端的链表, show cli server 汇总统计时使用 */
+static void cli_servers_link (cli_server_t *s)
+{
+    pthread_mutex_lock(&cli_servers_lock);
+    s->next_server = cli_servers;
+    cli_servers = s;
+    pthread_mutex_unlock(&cli_servers_lock);
+}
+
+static void cli_servers_unlink (cli_server_t *s)
+{
+    cli_server_t **p;
+
+    pthread_mutex_lock(&cli_servers_lock);
+    for (p = &cli_servers; *p; p = &(*p)->next_server) {
+        if (*p == s) {
+            *p = s->next_server;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cli_servers_lock);
+}
+
+static cli_server_t *cli_server_alloc (void)
+{
+    cli_server_t *s = (cli_server_t *) calloc(1, sizeof(cli_server_t));
+
+    if (!s)
+        return 0;
+    s->epoll_fd = s->listen_fd = s->event_fd = s->worker_event_fd = -1;
+    s->sched.mode = CLI_SCHED_COMMANDS;
+    s->sched.quantum = CLI_SCHED_QUANTUM;
+    pthread_mutex_init(&s->lock, 0);
+    pthread_cond_init(&s->jobs_cond, 0);
+    pthread_cond_init(&s->tx_cond, 0);
+    cli_servers_link(s);
+    return s;
+}
+
+/*
+ * 创建 epoll_fd, event_fd 和 worker_event_fd, 开始在 s->listen_fd 上接受连接.
+ * 其它线程交回输出, 转交请求或者唤醒挂起的命令时 worker_event_fd 可读, data.ptr 为 &s->worker_event_fd.
+ */
+static int cli_server_open (cli_server_t *s)
+{
+    struct epoll_event ev;
+
+    cli_server_stats = &s->stats;
+    if ((s->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        return -1;
+    if ((s->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        return -1;
+
+    ev.events = EPOLLIN;
+#ifdef CLI_USE_IO_URING
+    /* io_uring 不可用(内核太旧或者被禁用)时使用 epoll */
+    if ((s->uring = cli_uring_create())) {
+        /* 有完成事件时 io_uring 的 fd 可读, data.ptr 为 s->uring */
+        ev.data.ptr = s->uring;
+        if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->uring->fd, &ev) < 0)
+            return -1;
+        if (cli_uring_arm_accept(s) || cli_uring_submit(s->uring, 0))
+            return -1;
+    } else
+#endif
+    {
+        /*
+         * 监听 socket 的 data.ptr 为 s, event_fd 的为 &s->event_fd, 其它为 cli_conn_t.
+         * 多个分片共用监听 socket, EPOLLEXCLUSIVE 让一个新连接只唤醒其中一个分片.
+         */
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = s;
+        if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->listen_fd, &ev) < 0)
+            return -1;
+        ev.events = EPOLLIN;
+    }
+    ev.data.ptr = &s->event_fd;
+    if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->event_fd, &ev) < 0)
+        return -1;
+
+    if ((s->worker_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        return -1;
+    ev.data.ptr = &s->worker_event_fd;
+    return epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->worker_event_fd, &ev);
+}
+
+cli_server_t *cli_server_create (const char *path)
+{
+    cli_server_t *s = cli_server_alloc();
+
+    if (!s)
+        return 0;
+    if ((s->listen_fd = cli_server_listen(path)) < 0)
+        goto fail;
+    if (!(s->path = strdup(path)))
+        goto fail;
+    if (cli_server_open(s))
+        goto fail;
+    return s;
+
+fail:
+    cli_server_destroy(s);
+    return 0;
+}
+
+/* 停止分片的线程, 线程在下一次循环时看到 stopping 后退出 */
+static void cli_server_shard_stop (cli_server_t *shard)
+{
+    pthread_mutex_lock(&shard->lock);
+    __atomic_store_n(&shard->stopping, 1, __ATOMIC_RELEASE);
+    cli_server_signal(shard);
+    pthread_mutex_unlock(&shard->lock);
+    pthread_join(shard->thread, 0);
+}
+
+void cli_server_destroy (cli_server_t *s)
+{
+    cli_async_t *a;
+    cli_conn_t *conn;
+    cli_job_t *job;
+    int i;
+
+    /* 分片转交过来的请求属于分片的连接, 先停止并释放所有分片 */
+    for (i = 0; i < s->n_shards; i++) {
+        cli_server_shard_stop(s->shards[i]);
+        cli_server_destroy(s->shards[i]);
+    }
+    while ((job = s->main_jobs_head)) {
+        s->main_jobs_head = job->next;
+        free(job);
+    }
+
+    /* 再停止工作线程, 之后所有请求要么还在 jobs 队列中, 要么已经完成并在 events 队列中 */
+    pthread_mutex_lock(&s->lock);
+    s->stopping = 1;
+    pthread_cond_broadcast(&s->jobs_cond);
+    pthread_cond_broadcast(&s->tx_cond);
+    pthread_mutex_unlock(&s->lock);
+    for (i = 0; i < s->n_workers; i++)
+        pthread_join(s->workers[i], 0);
+    while ((job = s->jobs_head)) {
+        s->jobs_head = job->next;
+        free(job);
+    }
+    while ((job = s->events_head)) {
+        s->events_head = job->event_next;
+        cli_output_queue_discard(&job->handoff);
+        free(job);
+    }
+    for (i = 0; i < s->n_incoming; i++)
+        close(s->incoming[i]);
+    free(s->incoming);
+
+    /* 挂起的命令: 之后的 cli_resume 不再唤醒任何人, 输出队列也要随连接一起释放 */
+    for (a = s->suspended; a; a = a->next) {
+        pthread_mutex_lock(&a->lock);
+        a->wake = 0;
+        pthread_mutex_unlock(&a->lock);
+        cli_async_detach(a);
+    }
+
+    cli_servers_unlink(s);
+    cli_server_stats = &s->stats;
+#ifdef CLI_USE_IO_URING
+    /* 先关闭 io_uring, 在途的操作随之取消, 之后才能释放连接和输出段 */
+    if (s->uring)
+        cli_uring_destroy(s->uring);
+#endif
+    while ((conn = s->conns)) {
+        s->conns = conn->next;
+        /* 还没执行完的生成器命令 */
+        if (conn->tx.async)
+            cli_async_detach(conn->tx.async);
+        cli_conn_free(conn);
+    }
+    cli_server_stats = &cli_server_stats_default;
+
+    /* 监听 socket 属于 0 号分片 */
+    if (s->listen_fd >= 0 && !s->main)
+        close(s->listen_fd);
+    if (s->event_fd >= 0)
+        close(s->event_fd);
+    if (s->worker_event_fd >= 0)
+        close(s->worker_event_fd);
+    if (s->epoll_fd >= 0)
+        close(s->epoll_fd);
+    if (s->path)
+        unlink(s->path);
+    if (s->snapshot)
+        cli_snapshot_release(s->snapshot);
+    free(s->path);
+    free(s->workers);
+    free(s->shards);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->jobs_cond);
+    pthread_cond_destroy(&s->tx_cond);
+    free(s);
+}
+
+int cli_server_fd (cli_server_t *s)
+{
+    return s->epoll_fd;
+}
+
+int cli_server_set_sched (cli_server_t *s, const cli_sched_t *sched)
+{
+    if (s->n_shards || s->main || sched->quantum <= 0
+        || (sched->mode != CLI_SCHED_COMMANDS && sched->mode != CLI_SCHED_TIME))
+        return -1;
+    s->sched = *sched;
+    return 0;
+}
+
+int cli_server_set_workers (cli_server_t *s, int n)
+{
+    int i;
+
+    if (n <= 0 || s->n_workers || s->n_shards || s->main)
+        return -1;
+    if (!(s->workers = (pthread_t *) calloc(n, sizeof(pthread_t))))
+        return -1;
+
+    for (i = 0; i < n; i++) {
+        if (pthread_create(&s->workers[i], 0, cli_server_worker, s))
+            break;
+        s->n_workers++;
+    }
+
+    return s->n_workers ? 0 : -1;
+}
+
+/* 分片线程: 自己的事件循环, 绑定到进程可用的第 shard 个 CPU */
+static void *cli_server_shard_main (void *arg)
+{
+    cli_server_t *s = (cli_server_t *) arg;
+    struct pollfd pfd = { .fd = s->epoll_fd, .events = POLLIN };
+    cpu_set_t cpus, one;
+    cli_thread_t thread;
+    int cpu, k = 0;
+
+    if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0 && CPU_COUNT(&cpus) > 1) {
+        for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (!CPU_ISSET(cpu, &cpus) || k++ != s->shard % CPU_COUNT(&cpus))
+                continue;
+            CPU_ZERO(&one);
+            CPU_SET(cpu, &one);
+            pthread_setaffinity_np(pthread_self(), sizeof(one), &one);
+            break;
+        }
+    }
+
+    cli_thread_register(&thread);
+    thread.shard = s->shard;
+
+    while (!__atomic_load_n(&s->stopping, __ATOMIC_ACQUIRE)) {
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+            break;
+        if (cli_server_process(s, 64, 1000) < 0)
+            break;
+    }
+
+    cli_thread_unregister(&thread);
+    return 0;
+}
+
+int cli_server_set_shards (cli_server_t *s, int n)
+{
+    cli_server_t *shard;
+    int i;
+
+    if (n <= 1 || s->n_shards || s->n_workers || s->main)
+        return -1;
+    if (!(s->shards = (cli_server_t **) calloc(n - 1, sizeof(cli_server_t *))))
+        return -1;
+
+    /* 先创建所有分片再启动线程, 分片线程分配连接时 s->shards 已经不再变化 */
+    for (i = 1; i < n; i++) {
+        if (!(shard = cli_server_alloc()))
+            break;
+        shard->shard = i;
+        shard->main = s;
+        shard->listen_fd = s->listen_fd;
+        shard->snapshot = cli_snapshot_refresh(0);
+        if (cli_server_open(shard)) {
+            cli_server_destroy(shard);
+            break;
+        }
+        s->shards[s->n_shards++] = shard;
+    }
+    cli_server_stats = &s->stats;
+
+    for (i = 0; s->n_shards == n - 1 && i < s->n_shards; i++) {
+        if (pthread_create(&s->shards[i]->thread, 0, cli_server_shard_main, s->shards[i]))
+            break;
+    }
+    if (i == n - 1)
+        return 0;
+
+    /* 没有启动线程的分片直接释放, 已经启动的之后由 cli_server_destroy 停止 */
+    while (s->n_shards > i)
+        cli_server_destroy(s->shards[--s->n_shards]);
+    return -1;
+}
+
+/* 把新连接加入 s */
+static void cli_server_conn_add (cli_server_t *s, int fd)
+{
+    cli_conn_t *conn;
+
+#ifdef CLI_USE_IO_URING
+    if (s->uring) {
+        cli_uring_conn_create(s, fd);
+        return;
+    }
+#endif
+    if (!(conn = cli_conn_create(s->epoll_fd, fd))) {
+        close(fd);
+        return;
+    }
+    conn->server = s;
+    conn->tx.wake = cli_server_async_wake;
+    conn->tx.owner = s;
+    cli_server_conn_link(s, conn);
+
+    /* 连接建立前客户端可能已经发送了数据, 边缘触发不一定会再通知 */
+    conn->ready_events = EPOLLIN;
+    cli_server_ready_add(s, conn);
+}
+
+static void cli_server_accept (cli_server_t *s)
+{
+    int i, n;
+
+    /*
+     * 每次最多接受 16 个连接, 剩下的下次再处理(监听 socket 是水平触发的).
+     * 有多个分片时每次只接受一个, 让其它分片也能分到连接.
+     */
+    n = s->main || s->n_shards ? 1 : 16;
+    for (i = 0; i < n; i++) {
+        int fd;
+
+        cli_server_stats->syscalls++;
+        if ((fd = accept4(s->listen_fd, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0)
+            break;
+        cli_server_accepted(s, fd);
+    }
+}
+
+/* 用 epoll_wait 收集事件, 把有事件的连接加入就绪链表 */
+static int cli_server_poll (cli_server_t *s)
+{
+    struct epoll_event events[64];
+    cli_conn_t *conn;
+    int i, n;
+
+    cli_server_stats->syscalls++;
+    n = epoll_wait(s->epoll_fd, events, 64, 0);
+    if (n < 0)
+        return errno == EINTR ? 0 : -1;
+
+    for (i = 0; i < n; i++) {
+        void *p = events[i].data.ptr;
+
+        if (p == s) {
+            cli_server_accept(s);
+        } else if (p != &s->event_fd && p != &s->worker_event_fd) {
+            conn = (cli_conn_t *) p;
+            conn->ready_events |= events[i].events;
+            cli_server_ready_add(s, conn);
+        }
+    }
+
+    return 0;
+}
+
+int cli_server_process (cli_server_t *s, int max_commands, int max_usec)
+{
+    cli_budget_t budget;
+    cli_conn_t *conn, *last;
+    uint64_t v;
+
+    budget.commands = max_commands > 0 ? max_commands : INT_MAX;
+    budget.deadline = max_usec > 0 ? cli_server_now() + (uint64_t) max_usec * 1000 : 0;
+    cli_server_stats = &s->stats;
+    cli_server_stats->process_calls++;
+    /* 主线程 cli_freeze 之后切换到新的快照, 没有变化时只是一次原子读 */
+    s->snapshot = cli_snapshot_refresh(s->snapshot);
+
+#ifdef CLI_USE_IO_URING
+    if (s->uring)
+        cli_uring_poll(s);
+    else
+#endif
+    if (cli_server_poll(s))
+        return -1;
+    cli_server_jobs_poll(s);
+
+    /*
+     * 按赤字轮转处理就绪的连接: 每轮给连接增加一份额度, 这一次最多用完剩余的额度,
+     * 还有工作的连接放到链表尾部, 下次从下一个连接开始.
+     */
+    last = s->ready_tail;
+    while (last && (conn = cli_server_ready_pop(s))) {
+        cli_budget_t turn = budget;
+        uint64_t start = 0;
+        int rv, commands;
+
+        if (conn->quantum) {
+            conn->deficit += conn->quantum;
+            /* 还欠着额度, 先处理其它连接; 没有其它就绪的连接时不必等待 */
+            if (conn->deficit <= 0) {
+                if (s->ready_head) {
+                    cli_server_ready_add(s, conn);
+                    if (conn == last)
+                        break;
+                    continue;
+                }
+                conn->deficit = conn->quantum;
+            }
+            if (s->sched.mode == CLI_SCHED_TIME) {
+                start = cli_server_now();
+                if (!turn.deadline || start + conn->deficit < turn.deadline)
+                    turn.deadline = start + conn->deficit;
+            } else if (conn->deficit < turn.commands) {
+                turn.commands = (int) conn->deficit;
+            }
+        }
+        commands = turn.commands;
+
+#ifdef CLI_USE_IO_URING
+        if (s->uring) {
+            rv = cli_uring_conn_run((cli_uring_conn_t *) conn, &turn);
+        } else
+#endif
+        {
+            uint32_t ev = conn->ready_events;
+
+            conn->ready_events = 0;
+            rv = cli_conn_event(conn, ev, &turn);
+        }
+        commands -= turn.commands;
+        budget.commands -= commands;
+
+        if (rv < 0) {
+#ifdef CLI_USE_IO_URING
+            if (s->uring) {
+                cli_uring_conn_close((cli_uring_conn_t *) conn);
+            } else
+#endif
+            {
+                cli_server_conn_unlink(s, conn);
+                cli_conn_free(conn);
+            }
+        } else if (conn->quantum) {
+            conn->deficit -= start ? (int64_t) (cli_server_now() - start) : commands;
+            /* 没有工作可做时不保留剩余的额度, 欠下的仍然保留 */
+            if (!rv && conn->deficit > 0)
+                conn->deficit = 0;
+        }
+        if (rv > 0)
+            cli_server_ready_add(s, conn);
+        /* 发送队列有变化, 让等待的工作线程继续 */
+        if (rv >= 0 && conn->job)
+            cli_server_job_update(s, conn);
+
+        if (conn == last || cli_budget_exhausted(&budget))
+            break;
+    }
+
+#ifdef CLI_USE_IO_URING
+    /* 这一轮产生的 recv/send/cancel 一次提交 */
+    if (s->uring && cli_uring_submit(s->uring, 0))
+        return -1;
+#endif
+
+    /* 还有就绪的连接时让 event_fd 保持可读, 宿主的 poll 会马上再次返回 */
+    if (s->ready_head && !s->event_fd_signaled) {
+        v = 1;
+        cli_server_stats->syscalls++;
+        if (write(s->event_fd, &v, sizeof(v)) == sizeof(v))
+            s->event_fd_signaled = 1;
+    } else if (!s->ready_head && s->event_fd_signaled) {
+        cli_server_stats->syscalls++;
+        if (read(s->event_fd, &v, sizeof(v)) == sizeof(v))
+            s->event_fd_signaled = 0;
+    }
+
+    return s->ready_head ? 1 : 0;
+}
+
+static int show_cli_server_command_fn(cli_ctx_t* ctx)
+{
+    cli_server_stats_t total_stats = { 0 }, *s = &total_stats;
+    uint64_t writes = cli_output_writes(), total;
+    cli_server_t *server, *main = 0;
+    int uring = 0, shards = 0;
+
+    /* 其它分片的计数由各自的线程修改, 这里读到的可能稍旧 */
+    pthread_mutex_lock(&cli_servers_lock);
+    for (server = cli_servers; server; server = server->next_server) {
+        s->connections += server->stats.connections;
+        s->commands += server->stats.commands;
+        s->process_calls += server->stats.process_calls;
+        s->syscalls += server->stats.syscalls;
+        s->offloaded += server->stats.offloaded;
+        uring = server->uring != 0;
+        if (!server->main)
+            main = server;
+        shards++;
+    }
+    pthread_mutex_unlock(&cli_servers_lock);
+    total = s->syscalls + writes;
+
+    cli_output(ctx, NEW_LINE, "backend:       %s", uring ? "io_uring" : "epoll");
+    cli_output(ctx, NEW_LINE, "shards:        %d", shards);
+    cli_output(ctx, NEW_LINE, "connections:   %llu", (unsigned long long) s->connections);
+    cli_output(ctx, NEW_LINE, "commands:      %llu", (unsigned long long) s->commands);
+    cli_output(ctx, NEW_LINE, "process calls: %llu", (unsigned long long) s->process_calls);
+    cli_output(ctx, NEW_LINE, "syscalls:      %llu (writev %llu)",
+               (unsigned long long) total, (unsigned long long) writes);
+    cli_output(ctx, NEW_LINE, "  per command: %.2f", s->commands ? (double) total / s->commands : 0.0);
+    cli_output(ctx, NEW_LINE, "offloaded:     %llu", (unsigned long long) s->offloaded);
+    if (main)
+        cli_output(ctx, NEW_LINE, "sched:         drr, quantum %d %s", main->sched.quantum,
+                   main->sched.mode == CLI_SCHED_TIME ? "usec" : "commands");
+
+    if (shards > 1) {
+        pthread_mutex_lock(&cli_servers_lock);
+        for (server = cli_servers; server; server = server->next_server)
+            cli_output(ctx, NEW_LINE, "  shard %d: connections %llu commands %llu", server->shard,
+                       (unsigned long long) server->stats.connections,
+                       (unsigned long long) server->stats.commands);
+        pthread_mutex_unlock(&cli_servers_lock);
+    }
+    return 0;
+}
+
+CLI_COMMAND (show_cli_server_command) = {
+    .path = "show cli server",
+    .help = "Usage: show cli server",
+    .function = show_cli_server_command_fn,
+};
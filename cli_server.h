@@ -0,0 +1,241 @@
+#ifndef CLI_SERVER_H_
+#define CLI_SERVER_H_
+
+#include <stdint.h>
+#include "cli.h"
+
+/* 每个连接待发送数据的默认上限 */
+#define CLI_CONN_TX_LIMIT (256 << 10)
+/* 有请求在工作线程执行或者挂起时, 接收缓冲超过这个量就暂停读取 */
+#define CLI_CONN_RX_LIMIT (64 << 10)
+
+/* 一次 cli_server_process 最多执行的命令数和时间 */
+typedef struct
+{
+  int commands;
+  /* CLOCK_MONOTONIC 纳秒, 0 表示不限制时间 */
+  uint64_t deadline;
+} cli_budget_t;
+
+/* 连接调度的计量方式, 见 cli_server_set_sched */
+#define CLI_SCHED_COMMANDS 0
+#define CLI_SCHED_TIME 1
+
+/* 每个连接每轮的默认额度: 32 个命令 */
+#define CLI_SCHED_QUANTUM 32
+
+typedef struct
+{
+  /* CLI_SCHED_COMMANDS 时额度为命令数, CLI_SCHED_TIME 时为执行时间(微秒) */
+  int mode;
+  /* 每个连接每轮的默认额度 */
+  int quantum;
+  /*
+   * 不为 0 时在建立连接时调用, 返回这个连接每轮的额度(例如按 SO_PEERCRED 区分客户端),
+   * 返回值 <= 0 时使用默认额度. 有多个分片时在分片线程上调用.
+   */
+  int (*conn_quantum) (int fd, int quantum);
+} cli_sched_t;
+
+struct cli_server_t;
+struct cli_job_t;
+
+/* 一个客户端连接 */
+typedef struct cli_conn_t
+{
+  int fd;
+  int epoll_fd;
+  /* 当前在 epoll 中注册的事件 */
+  uint32_t events;
+  /* 对端已经关闭写端, 回复发送完后关闭连接 */
+  int eof;
+  /* 接收缓冲, 保存还没有收齐的帧 */
+  char *rx_buffer;
+  int rx_len;
+  int rx_capacity;
+  /*
+   * 待发送的回复, 流水线上的多个请求的回复合并发送.
+   * tx.limit 为待发送数据的上限, tx.overflow 为超过上限时的处理方式, 创建连接后可以修改.
+   */
+  cli_output_queue_t tx;
+
+  /* cli_server_t 中所有连接的链表 */
+  struct cli_conn_t *prev;
+  struct cli_conn_t *next;
+  /* cli_server_t 中待处理连接链表 */
+  struct cli_conn_t *ready_next;
+  int is_ready;
+  /* 还没有处理的 epoll 事件 */
+  uint32_t ready_events;
+  /* 所属的服务端, 单独使用 cli_conn_event 时为 0 */
+  struct cli_server_t *server;
+  /*
+   * 正在工作线程执行的请求, 完成之前不执行这个连接上后面的请求, 回复因此保持顺序.
+   * 挂起的请求(tx.async)也一样.
+   */
+  struct cli_job_t *job;
+  /* 赤字轮转: 每轮增加的额度和还能用的额度, 按命令数或纳秒计. quantum 为 0 时不限制 */
+  int64_t quantum;
+  int64_t deficit;
+} cli_conn_t;
+
+struct cli_uring_t;
+
+/* 服务端的统计, 每个分片一份, 由 show cli server 汇总输出 */
+typedef struct
+{
+  /* 接受的连接数 */
+  uint64_t connections;
+  /* 执行的命令数 */
+  uint64_t commands;
+  /* cli_server_process 的调用次数, 宿主每次调用前通常有一次 poll */
+  uint64_t process_calls;
+  /* cli_server.c 中的系统调用次数, 不含 cli.c 中发送输出的 writev */
+  uint64_t syscalls;
+  /* 交给其它线程执行的命令数 */
+  uint64_t offloaded;
+} cli_server_stats_t;
+
+/*
+ * 嵌入到宿主程序中的 cli 服务端.
+ * 所有 fd 都注册在内部的 epoll_fd 中, 宿主把 cli_server_fd 返回的 fd 加入自己的 poll 循环,
+ * 可读时调用 cli_server_process, 每次调用执行的命令数和时间都有上限.
+ *
+ * 定义 CLI_USE_IO_URING 编译时使用 io_uring 收发(需要 Linux 6.0 以上):
+ * 多次触发的 accept 和 recv, 接收使用内核选择的 provided buffer, 发送用 sendmsg 一次提交整个输出队列.
+ * 此时 epoll_fd 中只有 io_uring 的 fd 和 event_fd, 处理一批事件通常只需要一次 io_uring_enter.
+ * io_uring 不可用时仍然使用 epoll.
+ */
+typedef struct cli_server_t
+{
+  int epoll_fd;
+  int listen_fd;
+  /* 还有没处理完的连接时保持可读, 让宿主再次调用 cli_server_process */
+  int event_fd;
+  int event_fd_signaled;
+  /* 事件还没处理完的连接(额度或预算用完时剩下的), 按赤字轮转轮流处理 */
+  cli_conn_t *ready_head;
+  cli_conn_t *ready_tail;
+  cli_conn_t *conns;
+  char *path;
+  /* io_uring 后端, 为 0 时使用 epoll */
+  struct cli_uring_t *uring;
+  cli_server_stats_t stats;
+  /* 连接调度, 分片使用 0 号分片的设置 */
+  cli_sched_t sched;
+  /* 当前使用的命令树快照, 每次 cli_server_process 开始时更新 */
+  cli_snapshot_t *snapshot;
+
+  /*
+   * 分片: 第一个服务端为 0 号分片, cli_server_set_shards 创建的其它分片各有一个线程,
+   * 与 0 号分片共用监听 socket. main 指向 0 号分片, 0 号分片自己为 0.
+   */
+  int shard;
+  struct cli_server_t *main;
+  struct cli_server_t **shards;
+  int n_shards;
+  pthread_t thread;
+  /* 0 号分片上: 新连接的序号, 按序号轮流分给各个分片 */
+  int accept_seq;
+  /* 其它分片接受后分给这个分片的连接 */
+  int *incoming;
+  int n_incoming;
+  int incoming_capacity;
+  /* 分片转交给 0 号分片执行的请求(命令不是线程安全的) */
+  struct cli_job_t *main_jobs_head;
+  struct cli_job_t *main_jobs_tail;
+  /* 所有服务端的链表, show cli server 汇总统计时使用 */
+  struct cli_server_t *next_server;
+
+  /* 工作线程, 由 cli_server_set_workers 启动 */
+  int n_workers;
+  pthread_t *workers;
+  int stopping;
+  /* 等待执行的请求 */
+  struct cli_job_t *jobs_head;
+  struct cli_job_t *jobs_tail;
+  /* 有新输出或者已经完成的请求, 等 I/O 线程取走; 非空时 worker_event_fd 可读 */
+  struct cli_job_t *events_head;
+  struct cli_job_t *events_tail;
+  int worker_event_fd;
+  int worker_event_signaled;
+  /* 挂起的命令; 以及已经 cli_resume, 等 I/O 线程继续执行的命令, 由 lock 保护 */
+  cli_async_t *suspended;
+  cli_async_t *woken_head;
+  cli_async_t *woken_tail;
+  /* 保护上面的队列以及 cli_job_t 中与 I/O 线程共享的字段 */
+  pthread_mutex_t lock;
+  pthread_cond_t jobs_cond;
+  /* 连接的待发送数据降下来, 或者请求被取消 */
+  pthread_cond_t tx_cond;
+} cli_server_t;
+
+/* 创建连接并以边缘触发方式加入 epoll_fd, epoll_event.data.ptr 为连接本身 */
+cli_conn_t *cli_conn_create (int epoll_fd, int fd);
+
+/* 释放连接并关闭 fd */
+void cli_conn_free (cli_conn_t *conn);
+
+/*
+ * 连接上有 epoll 事件时调用(fd 需为非阻塞).
+ * 发送队列中的回复, 读出所有数据, 按帧重组后依次执行其中完整的请求.
+ * 客户端可以不等回复连续发送请求, 请求按顺序执行, 一次读到的多个请求的回复用一次 writev 发送.
+ * 回复发不出去时只在这期间注册 EPOLLOUT; 待发送的数据超过 tx.limit 时,
+ * PAUSE 策略暂停读取和执行后续请求, 等数据发送出去再继续, CLOSE 策略关闭连接.
+ * budget 不为 0 时每执行一个命令消耗一个预算, 预算用完时返回 1, 之后需要再次调用.
+ * 返回 -1 表示对端已关闭或出错, 调用者应当释放连接.
+ */
+int cli_conn_event (cli_conn_t *conn, uint32_t events, cli_budget_t *budget);
+
+/* 在 unix socket path 上监听, 出错返回 0. 连接由服务端管理, 宿主不需要处理单个连接 */
+cli_server_t *cli_server_create (const char *path);
+
+/*
+ * 关闭所有连接和监听 socket.
+ * 还挂起着的命令不再继续执行, 之后的 cli_resume 什么也不做, 句柄也不再释放.
+ */
+void cli_server_destroy (cli_server_t *s);
+
+/* 宿主需要等待可读的 fd */
+int cli_server_fd (cli_server_t *s);
+
+/*
+ * 分成 n 个分片, 每个分片一个事件循环: 除了宿主线程上的 0 号分片, 其它分片各自创建一个线程并绑定到一个 CPU.
+ * 分片共用监听 socket(EPOLLEXCLUSIVE 或各自的 io_uring accept), 新连接由内核交给其中一个分片,
+ * 之后连接上的请求都在这个分片上执行, 连接, 接收缓冲和输出段都属于分片自己, 热路径上不加共享的锁.
+ * 不是线程安全的命令转交给 0 号分片执行. 命令函数可以用 cli_shard_id() 得到所在的分片.
+ * 只能调用一次, 不能与 cli_server_set_workers 同时使用, 出错返回 -1.
+ */
+int cli_server_set_shards (cli_server_t *s, int n);
+
+/*
+ * 启动 n 个工作线程, 之后 I/O 线程(调用 cli_server_process 的线程)只负责收发和分帧,
+ * 匹配到的命令都带 CLI_COMMAND_THREAD_SAFE 的请求交给工作线程, 在 cli_freeze 发布的快照上执行,
+ * 其它请求仍然在 I/O 线程执行. 工作线程的输出随时交回 I/O 线程发送, 待发送数据超过 tx.limit 时等待.
+ * 同一个连接同时只有一个请求在工作线程执行, 多个连接的请求并行执行.
+ * 只能调用一次, 出错返回 -1.
+ */
+int cli_server_set_workers (cli_server_t *s, int n);
+
+/*
+ * 设置连接的调度. 就绪的连接按赤字轮转(deficit round-robin)轮流执行请求:
+ * 每轮给连接增加 quantum 的额度, 一次最多用完剩余的额度, 然后排到其它就绪连接后面,
+ * 用不完的额度留到下一轮, 连接没有请求可执行时清零, 空闲的连接不会攒下额度.
+ * 大量流水线请求的客户端因此不会让交互的客户端等待, 每个连接等待的时间只与就绪连接数和额度有关.
+ * 按时间计量时单个命令可能超出额度, 欠下的在之后几轮扣除, 期间先执行其它连接的请求.
+ * 默认按命令数, 每轮 CLI_SCHED_QUANTUM 个命令. 只影响之后建立的连接, 需要在 cli_server_set_shards 之前调用.
+ */
+int cli_server_set_sched (cli_server_t *s, const cli_sched_t *sched);
+
+/*
+ * 命令函数返回 CLI_PENDING 挂起时(见 cli_async), 服务端继续处理其它连接,
+ * cli_resume 之后在执行请求的 I/O 线程上继续执行它, 完成后再执行同一连接上后面的请求.
+ * 在工作线程执行的命令挂起时工作线程等待, 不影响 I/O 线程.
+ *
+ * 处理就绪的事件, 最多执行 max_commands 个命令, 最多用 max_usec 微秒(都为 0 时不限制).
+ * 时间在每个命令之间检查, 单个命令不会被打断.
+ * 返回 1 表示还有工作没做完(此时 cli_server_fd 保持可读), 0 表示没有待处理的工作, -1 表示出错.
+ */
+int cli_server_process (cli_server_t *s, int max_commands, int max_usec);
+
+#endif
@@ -1,163 +1,94 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <unistd.h>
-#include <fcntl.h>
-#include <sys/epoll.h>
 #include <errno.h>
-#include <sys/socket.h>
-#include <sys/un.h>
-#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
 #include "cli.h"
+#include "cli_server.h"
 
 #define SOCKET_PATH "/tmp/command_socket"
-#define MAX_EVENTS 10
-#define BUFFER_SIZE 1024
-#define PROMPT "> "
-
-int set_nonblocking(int fd) {
-    int flags = fcntl(fd, F_GETFL, 0);
-    if (flags == -1) return -1;
-    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
-}
-
-static int unix_socket_init(char* unix_sock_path) {
-    struct sockaddr_un server_addr;
-    int server_fd = -1;
 
-    if ((server_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
-        return server_fd;
+int main(int argc, char **argv) {
+    cli_server_t *server;
+    struct pollfd pfd;
+    cli_sched_t sched = { CLI_SCHED_COMMANDS, 0, 0 };
+    int workers = 0, shards = 0, opt;
+
+    while ((opt = getopt(argc, argv, "w:s:q:t:")) != -1) {
+        switch (opt) {
+            case 'w': workers = atoi(optarg); break;
+            case 's': shards = atoi(optarg); break;
+            case 'q': sched.mode = CLI_SCHED_COMMANDS; sched.quantum = atoi(optarg); break;
+            case 't': sched.mode = CLI_SCHED_TIME; sched.quantum = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-w workers] [-s shards] [-q commands | -t usec]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
     }
 
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sun_family = AF_UNIX;
-    strncpy(server_addr.sun_path, unix_sock_path, sizeof(server_addr.sun_path) - 1);
-
-    unlink(unix_sock_path);
-
-    if (bind(server_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        close(server_fd);
-        return -1;
-    }
+    cli_init();
 
-    // 设置服务器套接字为非阻塞
-    set_nonblocking(server_fd);
+    // 客户端断开时 writev 返回 EPIPE, 不要因为 SIGPIPE 退出
+    signal(SIGPIPE, SIG_IGN);
 
-    // 开始监听
-    if (listen(server_fd, SOMAXCONN) < 0) {
-        close(server_fd);
-        return -2;
+    server = cli_server_create(SOCKET_PATH);
+    if (!server) {
+        perror("cli_server_create");
+        exit(EXIT_FAILURE);
     }
 
-    return server_fd;
-}
-
-int main() {
-    int epoll_fd, server_fd, nfds;
-    struct epoll_event ev, events[MAX_EVENTS];
-    char buffer[BUFFER_SIZE];
-
-    cli_init();
-
-    // 创建 epoll 实例
-    if ((epoll_fd = epoll_create1(0)) == -1) {
-        perror("epoll_create1");
+    // -q N / -t USEC: 每个连接每轮最多执行 N 个命令或者 USEC 微秒, 然后轮到其它连接
+    if (sched.quantum > 0 && cli_server_set_sched(server, &sched)) {
+        perror("cli_server_set_sched");
         exit(EXIT_FAILURE);
     }
-    
-    server_fd = unix_socket_init(SOCKET_PATH);
-    if (server_fd < 0) {
-        perror("unix_socket_init");
+
+    // -w N: 线程安全的命令交给 N 个工作线程执行
+    if (workers > 0 && cli_server_set_workers(server, workers)) {
+        perror("cli_server_set_workers");
         exit(EXIT_FAILURE);
     }
-    // 监听标准输入 (文件描述符 0)
-    ev.events = EPOLLIN;
-    ev.data.fd = server_fd;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &ev) < 0) {
-        perror("epoll_ctl: server_fd");
+
+    // -s N: 每个核一个事件循环, 当前线程为 0 号分片
+    if (shards > 1 && cli_server_set_shards(server, shards)) {
+        perror("cli_server_set_shards");
         exit(EXIT_FAILURE);
     }
 
-    // 事件循环
+    // 宿主程序的事件循环, cli 只占用一个 fd, 每次最多执行 64 个命令或 1ms
+    pfd.fd = cli_server_fd(server);
+    pfd.events = POLLIN;
     while (1) {
-        nfds = epoll_wait(epoll_fd, events, MAX_EVENTS, 100); // 100ms timeout
-        
-        if (nfds < 0) {
+        if (poll(&pfd, 1, -1) < 0) {
             if (errno == EINTR) continue; // 被信号中断
-            perror("epoll_wait failed");
+            perror("poll failed");
             break;
         }
 
-        for (int i = 0; i < nfds; i++) {
-            // 处理新连接
-            if (events[i].data.fd == server_fd) {
-                struct sockaddr_un client_addr;
-                socklen_t client_len = sizeof(client_addr);
-                int client_fd = accept(server_fd, (struct sockaddr*)&client_addr, &client_len);
-                
-                if (client_fd < 0) {
-                    perror("accept failed");
-                    continue;
-                }
-                
-                printf("New client connected (fd=%d)\n", client_fd);
-                
-                // 设置客户端套接字为非阻塞
-                if (set_nonblocking(client_fd)) {
-                    perror("client nonblock failed");
-                    close(client_fd);
-                    continue;
-                }
-                
-                // 添加客户端到epoll
-                ev.events = EPOLLIN | EPOLLET; // 边缘触发模式
-                ev.data.fd = client_fd;
-                if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
-                    perror("epoll_ctl: client_fd");
-                    close(client_fd);
-                }
-            } 
-            // 处理客户端数据
-            else {
-                int client_fd = events[i].data.fd;
-                ssize_t bytes_read;
-                
-                // 读取客户端数据
-                while ((bytes_read = read(client_fd, buffer, BUFFER_SIZE - 1)) > 0) {
-                    cli_input(client_fd, buffer);
-
-                    memset(buffer, 0, sizeof(buffer));
-                }
-
-                if (bytes_read == 0 || (bytes_read < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
-                    printf("Client (fd=%d) disconnected\n", client_fd);
-                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client_fd, NULL);
-                    close(client_fd);
-                }
-            }
+        if (cli_server_process(server, 64, 1000) < 0) {
+            perror("cli_server_process");
+            break;
         }
     }
 
-    close(epoll_fd);
+    cli_server_destroy(server);
     return 0;
 }
 
+typedef struct
+{
+    int id;
+} show_instance_args_t;
+
 static int
 test_show_instance_command_fn(cli_ctx_t* input)
 {
-    int id = -1;
-
-    while (input->index < input->len)
-    {
-      if (unformat (input, "id %d", &id))
-	    ;
-      else
-        {
-            break;
-        }
-    }
+    show_instance_args_t *args = input->args;
 
-    if (id > 0)
-        cli_output(input, NEW_LINE, "id %d is shown", id);
+    if (args->id > 0)
+        cli_output(input, NEW_LINE, "id %d is shown", args->id);
     return 0;
 }
 
@@ -165,6 +96,122 @@ CLI_COMMAND (test_show_instance_command) = {
     .path = "show instance",
     .help = "Usage: show instance [id INDEX]",
     .function = test_show_instance_command_fn,
+    .flags = CLI_COMMAND_THREAD_SAFE,
+    .args = (cli_arg_t []) {
+        CLI_ARG ("id", CLI_ARG_INT, show_instance_args_t, id),
+        { 0 },
+    },
+    .args_size = sizeof (show_instance_args_t),
+};
+
+static int
+test_show_shard_command_fn(cli_ctx_t* input)
+{
+    cli_output(input, NEW_LINE, "shard %d", cli_shard_id());
+    return 0;
+}
+
+CLI_COMMAND (test_show_shard_command) = {
+    .path = "show shard",
+    .help = "Usage: show shard",
+    .function = test_show_shard_command_fn,
+    .flags = CLI_COMMAND_THREAD_SAFE,
+};
+
+typedef struct
+{
+    unsigned int delay;
+} show_dataplane_counters_args_t;
+
+/* 交给数据面的统计请求 */
+typedef struct
+{
+    unsigned int delay;
+    unsigned long long packets;
+    cli_async_t *async;
+} dataplane_counters_request_t;
+
+/* 模拟数据面: 在另一个线程中收集计数, 完成后唤醒挂起的命令 */
+static void *
+dataplane_counters_collect(void *arg)
+{
+    dataplane_counters_request_t *r = arg;
+
+    usleep(r->delay * 1000);
+    r->packets = 12345;
+    cli_resume(r->async);
+    return 0;
+}
+
+/* 异步命令: 等数据面返回结果期间挂起, 服务端继续处理其它连接 */
+static int
+test_show_dataplane_counters_command_fn(cli_ctx_t* input)
+{
+    show_dataplane_counters_args_t *args = input->args;
+    dataplane_counters_request_t *r = input->async_data;
+    pthread_t thread;
+
+    if (input->async_state == 0) {
+        r = cli_ctx_alloc(input, sizeof(*r));
+        r->delay = args->delay;
+        if (!(r->async = cli_async(input)))
+            return -1;
+        input->async_data = r;
+        input->async_state = 1;
+        if (pthread_create(&thread, 0, dataplane_counters_collect, r)) {
+            cli_output(input, NEW_LINE, "dataplane busy");
+            return -1;
+        }
+        pthread_detach(thread);
+        return CLI_PENDING;
+    }
+
+    cli_output(input, NEW_LINE, "rx packets %llu", r->packets);
+    return 0;
+}
+
+CLI_COMMAND (test_show_dataplane_counters_command) = {
+    .path = "show dataplane counters",
+    .help = "Usage: show dataplane counters [delay MSEC]",
+    .function = test_show_dataplane_counters_command_fn,
+    .args = (cli_arg_t []) {
+        CLI_ARG ("delay", CLI_ARG_UINT, show_dataplane_counters_args_t, delay),
+        { 0 },
+    },
+    .args_size = sizeof (show_dataplane_counters_args_t),
+};
+
+typedef struct
+{
+    unsigned int count;
+} show_routes_args_t;
+
+/* 生成器命令: 路由表很大时分段输出, 段与段之间服务端可以处理其它连接 */
+static int
+test_show_routes_command_fn(cli_ctx_t* input)
+{
+    show_routes_args_t *args = input->args;
+    unsigned int count = args->count ? args->count : 1000;
+
+    for (; input->cursor < count; input->cursor++) {
+        if (cli_output_chunk_full(input))
+            return CLI_MORE;
+        cli_output(input, NEW_LINE, "10.%u.%u.0/24 via 192.168.0.1",
+                   (unsigned) (input->cursor >> 8) & 0xff, (unsigned) input->cursor & 0xff);
+    }
+    return 0;
+}
+
+CLI_COMMAND (test_show_routes_command) = {
+    .path = "show routes",
+    .help = "Usage: show routes [count N]",
+    .function = test_show_routes_command_fn,
+    .flags = CLI_COMMAND_THREAD_SAFE,
+    .args = (cli_arg_t []) {
+        CLI_ARG ("count", CLI_ARG_UINT, show_routes_args_t, count),
+        { 0 },
+    },
+    .args_size = sizeof (show_routes_args_t),
 };
 
 static int
@@ -189,5 +236,6 @@ CLI_COMMAND (test_reload_config_command) = {
     .path = "reload config",
     .help = "Usage: reload config",
     .function = test_reload_config_command_fn,
+    .flags = CLI_COMMAND_MAIN_THREAD,
 };
 